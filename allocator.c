@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+
+typedef struct
+{
+  VkDeviceSize offset;
+  VkDeviceSize size;
+}MemRange;
+
+struct MemBlock
+{
+  VkDeviceMemory memory;
+  VkDeviceSize size;
+  uint32_t type_index;
+  bool linear;
+  void *mapped;
+  // Free ranges sorted by offset, adjacent ranges are always merged.
+  MemRange *free_ranges;
+  uint32_t free_count;
+  uint32_t free_capacity;
+  uint32_t allocation_count;
+  VkDeviceSize used_bytes;
+  MemBlock *next;
+};
+
+static VkDeviceSize align_up(VkDeviceSize value, VkDeviceSize alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static void insert_free_range(MemBlock *block, uint32_t index, MemRange range)
+{
+  if (block->free_count == block->free_capacity) {
+    block->free_capacity = block->free_capacity ? block->free_capacity * 2 : 8;
+    block->free_ranges = realloc(block->free_ranges, block->free_capacity * sizeof(MemRange));
+    if (block->free_ranges == NULL) {
+      fprintf(stderr, "ERROR: Could not grow memory block free list\n");
+      exit(1);
+    }
+  }
+
+  memmove(&block->free_ranges[index + 1], &block->free_ranges[index], (block->free_count - index) * sizeof(MemRange));
+  block->free_ranges[index] = range;
+  ++block->free_count;
+}
+
+static void remove_free_range(MemBlock *block, uint32_t index)
+{
+  memmove(&block->free_ranges[index], &block->free_ranges[index + 1], (block->free_count - index - 1) * sizeof(MemRange));
+  --block->free_count;
+}
+
+void mem_allocator_init(MemAllocator *allocator, VkPhysicalDevice physical_device, VkDevice device)
+{
+  *allocator = (MemAllocator) {.device = device};
+  vkGetPhysicalDeviceMemoryProperties(physical_device, &allocator->mem_properties);
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  allocator->max_allocation_count = properties.limits.maxMemoryAllocationCount;
+}
+
+void mem_allocator_destroy(MemAllocator *allocator)
+{
+  MemBlock *block = allocator->blocks;
+  while (block != NULL) {
+    MemBlock *next = block->next;
+    if (block->allocation_count > 0) {
+      fprintf(stderr, "WARNING: Destroying memory block with %u live allocations\n", block->allocation_count);
+    }
+    vkFreeMemory(allocator->device, block->memory, NULL);
+    free(block->free_ranges);
+    free(block);
+    block = next;
+  }
+  allocator->blocks = NULL;
+  allocator->device_allocation_count = 0;
+}
+
+uint32_t mem_find_type(MemAllocator *allocator, uint32_t type_bits, VkMemoryPropertyFlags flags)
+{
+  for (uint32_t i = 0; i < allocator->type_cache_count; ++i) {
+    MemTypeCacheEntry *entry = &allocator->type_cache[i];
+    if (entry->type_bits == type_bits && entry->flags == flags) {
+      return entry->type_index;
+    }
+  }
+
+  const VkPhysicalDeviceMemoryProperties *mem_properties = &allocator->mem_properties;
+  for (uint32_t i = 0; i < mem_properties->memoryTypeCount; i++) {
+    if ((type_bits & (1 << i)) && (mem_properties->memoryTypes[i].propertyFlags & flags) == flags) {
+      if (allocator->type_cache_count < MEM_TYPE_CACHE_SIZE) {
+	allocator->type_cache[allocator->type_cache_count++] = (MemTypeCacheEntry) {
+	  .type_bits = type_bits,
+	  .flags = flags,
+	  .type_index = i,
+	};
+      }
+      return i;
+    }
+  }
+
+  fprintf(stderr, "ERROR: Failed to find suitable memory type\n");
+  exit(1);
+}
+
+static MemBlock *create_block(MemAllocator *allocator, uint32_t type_index, bool linear, VkDeviceSize min_size)
+{
+  if (allocator->device_allocation_count >= allocator->max_allocation_count) {
+    fprintf(stderr, "ERROR: Reached maxMemoryAllocationCount (%u)\n", allocator->max_allocation_count);
+    exit(1);
+  }
+
+  // Small heaps, such as a 256MB host visible BAR, get proportionally smaller blocks.
+  uint32_t heap_index = allocator->mem_properties.memoryTypes[type_index].heapIndex;
+  VkDeviceSize block_size = MEM_BLOCK_SIZE;
+  VkDeviceSize heap_size = allocator->mem_properties.memoryHeaps[heap_index].size;
+  if (heap_size / 8 < block_size) {
+    block_size = heap_size / 8;
+  }
+  if (block_size < min_size) {
+    block_size = min_size;
+  }
+
+  VkMemoryAllocateInfo alloc_info = {
+    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+    .allocationSize = block_size,
+    .memoryTypeIndex = type_index,
+  };
+
+  VkDeviceMemory memory;
+  if (vkAllocateMemory(allocator->device, &alloc_info, NULL, &memory) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to allocate %llu byte memory block\n", (unsigned long long) block_size);
+    exit(1);
+  }
+  ++allocator->device_allocation_count;
+
+  MemBlock *block = calloc(1, sizeof(MemBlock));
+  if (block == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate memory block\n");
+    exit(1);
+  }
+  block->memory = memory;
+  block->size = block_size;
+  block->type_index = type_index;
+  block->linear = linear;
+  insert_free_range(block, 0, (MemRange) {.offset = 0, .size = block_size});
+
+  if (allocator->mem_properties.memoryTypes[type_index].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+    if (vkMapMemory(allocator->device, memory, 0, VK_WHOLE_SIZE, 0, &block->mapped) != VK_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to map memory block\n");
+      exit(1);
+    }
+  }
+
+  block->next = allocator->blocks;
+  allocator->blocks = block;
+  return block;
+}
+
+// First fit over the block's free list.
+static bool block_alloc(MemBlock *block, VkDeviceSize size, VkDeviceSize alignment, MemAllocation *allocation)
+{
+  for (uint32_t i = 0; i < block->free_count; ++i) {
+    MemRange range = block->free_ranges[i];
+    VkDeviceSize offset = align_up(range.offset, alignment);
+    if (offset + size > range.offset + range.size) {
+      continue;
+    }
+
+    MemRange head = {.offset = range.offset, .size = offset - range.offset};
+    MemRange tail = {.offset = offset + size, .size = range.offset + range.size - (offset + size)};
+    remove_free_range(block, i);
+    if (tail.size > 0) {
+      insert_free_range(block, i, tail);
+    }
+    if (head.size > 0) {
+      insert_free_range(block, i, head);
+    }
+
+    ++block->allocation_count;
+    block->used_bytes += size;
+    *allocation = (MemAllocation) {
+      .memory = block->memory,
+      .offset = offset,
+      .size = size,
+      .mapped = block->mapped ? (char *) block->mapped + offset : NULL,
+      .block = block,
+    };
+    return true;
+  }
+  return false;
+}
+
+void mem_alloc(MemAllocator *allocator, const VkMemoryRequirements *reqs, VkMemoryPropertyFlags flags, bool linear, MemAllocation *allocation)
+{
+  uint32_t type_index = mem_find_type(allocator, reqs->memoryTypeBits, flags);
+  VkDeviceSize alignment = reqs->alignment > 0 ? reqs->alignment : 1;
+
+  for (MemBlock *block = allocator->blocks; block != NULL; block = block->next) {
+    if (block->type_index == type_index && block->linear == linear &&
+	block_alloc(block, reqs->size, alignment, allocation)) {
+      return;
+    }
+  }
+
+  MemBlock *block = create_block(allocator, type_index, linear, reqs->size);
+  if (!block_alloc(block, reqs->size, alignment, allocation)) {
+    fprintf(stderr, "ERROR: Fresh memory block cannot hold %llu bytes\n", (unsigned long long) reqs->size);
+    exit(1);
+  }
+}
+
+void mem_free(MemAllocator *allocator, MemAllocation *allocation)
+{
+  (void) allocator;
+  MemBlock *block = allocation->block;
+  if (block == NULL) {
+    return;
+  }
+
+  MemRange range = {.offset = allocation->offset, .size = allocation->size};
+  uint32_t index = 0;
+  while (index < block->free_count && block->free_ranges[index].offset < range.offset) {
+    ++index;
+  }
+
+  // Merge with the neighbouring free ranges so the free list never holds adjacent ranges.
+  if (index < block->free_count && range.offset + range.size == block->free_ranges[index].offset) {
+    range.size += block->free_ranges[index].size;
+    remove_free_range(block, index);
+  }
+  if (index > 0) {
+    MemRange *prev = &block->free_ranges[index - 1];
+    if (prev->offset + prev->size == range.offset) {
+      prev->size += range.size;
+      range.size = 0;
+    }
+  }
+  if (range.size > 0) {
+    insert_free_range(block, index, range);
+  }
+
+  --block->allocation_count;
+  block->used_bytes -= allocation->size;
+  *allocation = (MemAllocation) {0};
+}
+
+MemStats mem_get_stats(const MemAllocator *allocator)
+{
+  MemStats stats = {0};
+  VkDeviceSize free_bytes = 0;
+  for (const MemBlock *block = allocator->blocks; block != NULL; block = block->next) {
+    ++stats.block_count;
+    stats.allocation_count += block->allocation_count;
+    stats.reserved_bytes += block->size;
+    stats.used_bytes += block->used_bytes;
+    stats.free_range_count += block->free_count;
+    for (uint32_t i = 0; i < block->free_count; ++i) {
+      free_bytes += block->free_ranges[i].size;
+      if (block->free_ranges[i].size > stats.largest_free_range) {
+	stats.largest_free_range = block->free_ranges[i].size;
+      }
+    }
+  }
+  stats.fragmentation = free_bytes > 0 ? 1.0 - (double) stats.largest_free_range / free_bytes : 0.0;
+  return stats;
+}
+
+void mem_stats_print_json(FILE *out, const char *name, MemStats stats)
+{
+  fprintf(out, "\"%s\": {\"blocks\": %u, \"allocations\": %u, \"reserved_bytes\": %llu, \"used_bytes\": %llu, "
+	  "\"free_ranges\": %u, \"largest_free_range\": %llu, \"fragmentation\": %.4f}",
+	  name, stats.block_count, stats.allocation_count, (unsigned long long) stats.reserved_bytes,
+	  (unsigned long long) stats.used_bytes, stats.free_range_count, (unsigned long long) stats.largest_free_range,
+	  stats.fragmentation);
+}
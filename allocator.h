@@ -0,0 +1,62 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <vulkan/vulkan.h>
+
+// Default size of a VkDeviceMemory block. Requests larger than this get a block of their own.
+#define MEM_BLOCK_SIZE (64ull * 1024 * 1024)
+#define MEM_TYPE_CACHE_SIZE 16
+
+typedef struct MemBlock MemBlock;
+
+typedef struct
+{
+  VkDeviceMemory memory;
+  VkDeviceSize offset;
+  VkDeviceSize size;
+  void *mapped; // Persistently mapped pointer to offset, NULL unless the memory is host visible.
+  MemBlock *block;
+}MemAllocation;
+
+typedef struct
+{
+  uint32_t type_bits;
+  VkMemoryPropertyFlags flags;
+  uint32_t type_index;
+}MemTypeCacheEntry;
+
+typedef struct
+{
+  VkDevice device;
+  VkPhysicalDeviceMemoryProperties mem_properties;
+  uint32_t max_allocation_count;
+  uint32_t device_allocation_count;
+  MemBlock *blocks;
+  MemTypeCacheEntry type_cache[MEM_TYPE_CACHE_SIZE];
+  uint32_t type_cache_count;
+}MemAllocator;
+
+typedef struct
+{
+  uint32_t block_count;
+  uint32_t allocation_count;
+  VkDeviceSize reserved_bytes;
+  VkDeviceSize used_bytes;
+  uint32_t free_range_count;
+  VkDeviceSize largest_free_range;
+  double fragmentation; // 1 - largest free range / total free bytes, 0 when free space is contiguous.
+}MemStats;
+
+void mem_allocator_init(MemAllocator *allocator, VkPhysicalDevice physical_device, VkDevice device);
+void mem_allocator_destroy(MemAllocator *allocator);
+uint32_t mem_find_type(MemAllocator *allocator, uint32_t type_bits, VkMemoryPropertyFlags flags);
+// linear is true for buffers and linear images. Optimal-tiling images are kept in separate blocks
+// so neighbouring resources never have to be padded to bufferImageGranularity.
+void mem_alloc(MemAllocator *allocator, const VkMemoryRequirements *reqs, VkMemoryPropertyFlags flags, bool linear, MemAllocation *allocation);
+void mem_free(MemAllocator *allocator, MemAllocation *allocation);
+MemStats mem_get_stats(const MemAllocator *allocator);
+void mem_stats_print_json(FILE *out, const char *name, MemStats stats);
+
+#endif // ALLOCATOR_H
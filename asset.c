@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "asset.h"
+
+bool asset_map(const char *file_path, AssetView *view)
+{
+  *view = (AssetView) {0};
+
+  int fd = open(file_path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open file %s\n", file_path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    fprintf(stderr, "ERROR: Could not read file %s\n", file_path);
+    close(fd);
+    return false;
+  }
+
+  size_t size = (size_t) st.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Could not map file %s\n", file_path);
+    return false;
+  }
+  // Assets are consumed front to back exactly once, so let the kernel read ahead aggressively.
+  madvise(mapping, size, MADV_SEQUENTIAL);
+
+  view->data = mapping;
+  view->size = size;
+  view->mapping = mapping;
+  view->mapping_size = size;
+  return true;
+}
+
+void asset_release(AssetView *view)
+{
+  if (view->mapping != NULL) {
+    munmap(view->mapping, view->mapping_size);
+  }
+  *view = (AssetView) {0};
+}
+
+static void asset_load_job(void *arg)
+{
+  AssetRequest *request = arg;
+  AssetView view;
+  bool ok = asset_map(request->file_path, &view);
+
+  if (ok) {
+    // Fault every page in here, so the consumer never blocks on disk reads.
+    madvise(view.mapping, view.mapping_size, MADV_WILLNEED);
+    long page_size = sysconf(_SC_PAGESIZE);
+    const volatile unsigned char *bytes = view.data;
+    for (size_t offset = 0; offset < view.size; offset += (size_t) page_size) {
+      (void) bytes[offset];
+    }
+  }
+
+  pthread_mutex_lock(&request->mutex);
+  request->view = view;
+  request->state = ok ? ASSET_READY : ASSET_FAILED;
+  pthread_cond_signal(&request->done);
+  pthread_mutex_unlock(&request->mutex);
+}
+
+void asset_request(ThreadPool *pool, AssetRequest *request, const char *file_path)
+{
+  *request = (AssetRequest) {
+    .file_path = file_path,
+    .state = ASSET_PENDING,
+  };
+  pthread_mutex_init(&request->mutex, NULL);
+  pthread_cond_init(&request->done, NULL);
+  thread_pool_submit(pool, asset_load_job, request);
+}
+
+// Blocks until the worker has finished with request. Returns whether request->view holds the file.
+bool asset_wait(AssetRequest *request)
+{
+  if (!request->waited) {
+    pthread_mutex_lock(&request->mutex);
+    while (request->state == ASSET_PENDING) {
+      pthread_cond_wait(&request->done, &request->mutex);
+    }
+    pthread_mutex_unlock(&request->mutex);
+    pthread_cond_destroy(&request->done);
+    pthread_mutex_destroy(&request->mutex);
+    request->waited = true;
+  }
+  return request->state == ASSET_READY;
+}
@@ -0,0 +1,42 @@
+#ifndef ASSET_H
+#define ASSET_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+// Read-only view of a whole file. The data stays valid until asset_release().
+typedef struct
+{
+  const void *data;
+  size_t size;
+  void *mapping;
+  size_t mapping_size;
+}AssetView;
+
+typedef enum {
+  ASSET_PENDING,
+  ASSET_READY,
+  ASSET_FAILED,
+}AssetState;
+
+// A file mapped and paged in on a worker thread. The request must stay at a fixed address
+// until asset_wait() returns; the view then belongs to the caller.
+typedef struct
+{
+  const char *file_path;
+  AssetView view;
+  AssetState state;
+  bool waited;
+  pthread_mutex_t mutex;
+  pthread_cond_t done;
+}AssetRequest;
+
+bool asset_map(const char *file_path, AssetView *view);
+void asset_release(AssetView *view);
+void asset_request(ThreadPool *pool, AssetRequest *request, const char *file_path);
+bool asset_wait(AssetRequest *request);
+
+#endif // ASSET_H
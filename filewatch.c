@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "filewatch.h"
+
+static bool has_suffix(const char *name, const char *suffix)
+{
+  size_t name_length = strlen(name);
+  size_t suffix_length = strlen(suffix);
+  return name_length >= suffix_length && strcmp(name + name_length - suffix_length, suffix) == 0;
+}
+
+// Drains the non-blocking inotify descriptor. Returns true if any event names a watched file.
+static bool read_events(FileWatcher *watcher)
+{
+  char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  bool matched = false;
+
+  for (;;) {
+    ssize_t length = read(watcher->inotify_fd, buffer, sizeof(buffer));
+    if (length <= 0) {
+      break;
+    }
+    for (char *cursor = buffer; cursor < buffer + length;) {
+      const struct inotify_event *event = (const struct inotify_event *) cursor;
+      if (event->len > 0 && has_suffix(event->name, watcher->suffix)) {
+	matched = true;
+      }
+      cursor += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  return matched;
+}
+
+static void *watch_thread(void *arg)
+{
+  FileWatcher *watcher = arg;
+  struct pollfd fds[2] = {
+    {.fd = watcher->inotify_fd, .events = POLLIN},
+    {.fd = watcher->stop_fd, .events = POLLIN},
+  };
+  bool pending = false;
+
+  for (;;) {
+    // Sleeps until something happens, or until a pending change has settled.
+    int ready = poll(fds, 2, pending ? FILE_WATCH_SETTLE_MS : -1);
+    if (ready < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      fprintf(stderr, "WARNING: File watcher stopped: %s\n", strerror(errno));
+      break;
+    }
+    if (fds[1].revents != 0) {
+      break;
+    }
+    if (ready == 0) {
+      pending = false;
+      watcher->fn(watcher->arg);
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      pending = read_events(watcher) || pending;
+    }
+  }
+  return NULL;
+}
+
+bool file_watcher_start(FileWatcher *watcher, const char *dir_path, const char *suffix, FileWatchFn fn, void *arg)
+{
+  *watcher = (FileWatcher) {
+    .suffix = suffix,
+    .fn = fn,
+    .arg = arg,
+    .inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC),
+    .stop_fd = eventfd(0, EFD_CLOEXEC),
+  };
+
+  // Compilers either rewrite the file in place or rename a temporary over it.
+  if (watcher->inotify_fd < 0 || watcher->stop_fd < 0 ||
+      inotify_add_watch(watcher->inotify_fd, dir_path, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    fprintf(stderr, "WARNING: Could not watch %s: %s\n", dir_path, strerror(errno));
+  } else if (pthread_create(&watcher->thread, NULL, watch_thread, watcher) != 0) {
+    fprintf(stderr, "WARNING: Could not start file watcher thread\n");
+  } else {
+    return true;
+  }
+
+  if (watcher->inotify_fd >= 0) {
+    close(watcher->inotify_fd);
+  }
+  if (watcher->stop_fd >= 0) {
+    close(watcher->stop_fd);
+  }
+  watcher->inotify_fd = watcher->stop_fd = -1;
+  return false;
+}
+
+// Waits for a callback that is already running, then joins the thread. Harmless after a failed
+// file_watcher_start.
+void file_watcher_stop(FileWatcher *watcher)
+{
+  if (watcher->stop_fd < 0) {
+    return;
+  }
+
+  uint64_t one = 1;
+  if (write(watcher->stop_fd, &one, sizeof(one)) != sizeof(one)) {
+    fprintf(stderr, "WARNING: Could not signal file watcher thread\n");
+  }
+  pthread_join(watcher->thread, NULL);
+  close(watcher->inotify_fd);
+  close(watcher->stop_fd);
+  watcher->inotify_fd = watcher->stop_fd = -1;
+}
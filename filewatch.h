@@ -0,0 +1,29 @@
+#ifndef FILEWATCH_H
+#define FILEWATCH_H
+
+#include <stdbool.h>
+#include <pthread.h>
+
+// Milliseconds without further changes before the callback runs, so a compiler writing several
+// outputs triggers one call instead of one per file.
+#define FILE_WATCH_SETTLE_MS 100
+
+typedef void (*FileWatchFn)(void *arg);
+
+// Watches one directory with inotify on its own thread and calls fn on that thread after files
+// ending in suffix were written or moved into it. fn may block; changes made meanwhile are
+// picked up once it returns.
+typedef struct
+{
+  const char *suffix;
+  FileWatchFn fn;
+  void *arg;
+  int inotify_fd;
+  int stop_fd;
+  pthread_t thread;
+}FileWatcher;
+
+bool file_watcher_start(FileWatcher *watcher, const char *dir_path, const char *suffix, FileWatchFn fn, void *arg);
+void file_watcher_stop(FileWatcher *watcher);
+
+#endif // FILEWATCH_H
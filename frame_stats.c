@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "frame_stats.h"
+
+void sample_history_init(SampleHistory *history, size_t capacity)
+{
+  *history = (SampleHistory) {0};
+  history->samples = malloc(capacity * sizeof(double));
+  if (history->samples == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate sample history\n");
+    exit(1);
+  }
+  history->capacity = capacity;
+}
+
+void sample_history_free(SampleHistory *history)
+{
+  free(history->samples);
+  *history = (SampleHistory) {0};
+}
+
+void sample_history_reset(SampleHistory *history)
+{
+  history->count = 0;
+  history->next = 0;
+}
+
+void sample_history_push(SampleHistory *history, double value)
+{
+  if (history->capacity == 0) {
+    return;
+  }
+
+  history->samples[history->next] = value;
+  history->next = (history->next + 1) % history->capacity;
+  if (history->count < history->capacity) {
+    ++history->count;
+  }
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double lhs = *(const double *) a;
+  double rhs = *(const double *) b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+// Nearest-rank percentile over an ascending array.
+static double percentile(const double *sorted, size_t count, double p)
+{
+  size_t rank = (size_t) ceil(p / 100.0 * count);
+  if (rank < 1) rank = 1;
+  if (rank > count) rank = count;
+  return sorted[rank - 1];
+}
+
+SampleSummary sample_history_summarize(const SampleHistory *history)
+{
+  SampleSummary summary = {.count = history->count};
+  if (history->count == 0) {
+    return summary;
+  }
+
+  double *sorted = malloc(history->count * sizeof(double));
+  if (sorted == NULL) {
+    fprintf(stderr, "WARNING: Could not allocate samples for summary\n");
+    return summary;
+  }
+  memcpy(sorted, history->samples, history->count * sizeof(double));
+  qsort(sorted, history->count, sizeof(double), compare_doubles);
+
+  summary.p50 = percentile(sorted, history->count, 50.0);
+  summary.p95 = percentile(sorted, history->count, 95.0);
+  summary.p99 = percentile(sorted, history->count, 99.0);
+  summary.max = sorted[history->count - 1];
+
+  free(sorted);
+  return summary;
+}
+
+void sample_summary_print_json(FILE *out, const char *name, SampleSummary summary)
+{
+  fprintf(out, "\"%s\": {\"samples\": %zu, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f}",
+	  name, summary.count, summary.p50, summary.p95, summary.p99, summary.max);
+}
@@ -0,0 +1,32 @@
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+// Rolling window of timing samples in milliseconds. Once full, the oldest sample is overwritten.
+typedef struct
+{
+  double *samples;
+  size_t capacity;
+  size_t count;
+  size_t next;
+}SampleHistory;
+
+typedef struct
+{
+  size_t count;
+  double p50;
+  double p95;
+  double p99;
+  double max;
+}SampleSummary;
+
+void sample_history_init(SampleHistory *history, size_t capacity);
+void sample_history_free(SampleHistory *history);
+void sample_history_reset(SampleHistory *history);
+void sample_history_push(SampleHistory *history, double value);
+SampleSummary sample_history_summarize(const SampleHistory *history);
+void sample_summary_print_json(FILE *out, const char *name, SampleSummary summary);
+
+#endif // FRAME_STATS_H
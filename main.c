@@ -5,48 +5,165 @@
 #include <string.h>
 #include <unistd.h>
 #include <math.h>
+#include <signal.h>
+#include <stdatomic.h>
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 
 #include "cglm/cglm.h"
 #include "util.h"
+#include "frame_stats.h"
+#include "allocator.h"
+#include "mesh.h"
+#include "threadpool.h"
+#include "asset.h"
+#include "sim.h"
+#include "transform.h"
+#include "filewatch.h"
 
 #define WIDTH 800
 #define HEIGHT 600
-#define MAX_FRAMES_IN_FLIGHT 2
+// Upper bound for --frames-in-flight. Per-frame arrays are sized for it, only the first
+// config.frames_in_flight entries are used.
+#define MAX_FRAMES_IN_FLIGHT 8
 
 typedef struct
 {
-  vec2 position;
+  vec3 position;
   vec3 color;
 }Vertex;
 
+// The CPU multiplies projection, view and model once per draw, so the vertex shader only applies
+// the final matrix (and the per-instance model).
 typedef struct
 {
-  mat4 model;
-  mat4 view;
-  mat4 proj;
+  mat4 mvp;
 }UniformBufferObject;
 
-static const Vertex vertices[4] = {
-  {{-0.5f, -0.5f}, {1.0f, 0.0f, 0.0f}},
-  {{0.5f, -0.5f},  {0.0f, 1.0f, 0.0f}},
-  {{0.5f, 0.5f},   {0.0f, 0.0f, 1.0f}},
-  {{-0.5f, 0.5f},  {1.0f, 1.0f, 1.0f}},
+// Per-draw matrix when the push constant path is selected; the UBO is then left unused.
+typedef struct
+{
+  mat4 mvp;
+}PushConstants;
+
+// Vertex shader specialization constants choosing where the per-draw matrix and the instance
+// data come from.
+#define SPEC_CONSTANT_PUSH_MODEL 0
+#define SPEC_CONSTANT_GPU_CULL 1
+
+// One entry of the draw list: an indexed draw of the mesh over a range of instances.
+typedef struct
+{
+  uint32_t first_instance;
+  uint32_t instance_count;
+}DrawCmd;
+
+// Per-instance vertex data, read through binding 1. The mat4 takes locations 2 to 5, the color 6.
+#define INSTANCE_ATTRIB_LOCATION 2
+#define INSTANCE_ATTRIB_COUNT 5
+typedef struct
+{
+  mat4 model;
+  vec4 color;
+}InstanceData;
+
+// Built-in geometry, drawn when no --mesh is given.
+static const Vertex quad_vertices[4] = {
+  {{-0.5f, -0.5f, 0.0f}, {1.0f, 0.0f, 0.0f}},
+  {{0.5f, -0.5f, 0.0f},  {0.0f, 1.0f, 0.0f}},
+  {{0.5f, 0.5f, 0.0f},   {0.0f, 0.0f, 1.0f}},
+  {{-0.5f, 0.5f, 0.0f},  {1.0f, 1.0f, 1.0f}},
 };
 
-static const uint16_t indices[6] = {
+static const uint16_t quad_indices[6] = {
   0, 1, 2, 2, 3, 0,
 };
 
-#define QUEUE_COUNT 2
+typedef struct {
+  bool headless;
+  uint32_t bench_frames;
+  const char *mesh_path;
+  // Set when mesh_path was read from a config file and has to be freed.
+  char *owned_mesh_path;
+  uint32_t instance_count;
+  uint32_t draw_count;
+  uint32_t record_threads;
+  bool cache_commands;
+  bool push_constants;
+  bool gpu_cull;
+  bool hot_reload;
+  uint32_t pipeline;
+  uint32_t frames_in_flight;
+  uint32_t swapchain_images;
+  VkPresentModeKHR present_mode;
+  bool present_mode_set;
+}Config;
+
+Config config = {
+  .instance_count = 1,
+  .draw_count = 1,
+  .frames_in_flight = 2,
+};
+
+// Worker threads shared by every background job.
+ThreadPool thread_pool;
+
+// The scene advances at a fixed rate on its own thread. The render thread samples the latest step,
+// so neither a slow frame nor a slow step holds up the other.
+#define SIM_STEP_MS (1000.0 / 120.0)
+Simulation simulation;
+
+// Files needed by init_vulkan(). They are requested before device setup starts, so the disk
+// reads overlap instance and device creation instead of running one after another.
+#define VERT_SHADER_PATH "./shaders/vert.spv"
+#define FRAG_SHADER_PATH "./shaders/frag.spv"
+#define CULL_SHADER_PATH "./shaders/cull.spv"
+typedef struct {
+  AssetRequest vert_shader;
+  AssetRequest frag_shader;
+  AssetRequest cull_shader;
+  AssetRequest pipeline_cache;
+  AssetRequest mesh;
+  bool pipeline_cache_requested;
+}StartupAssets;
+
+StartupAssets startup_assets;
+
+#define FRAME_STATS_HISTORY 1024
+// Frames rendered before the benchmark starts measuring, so pipeline and driver warm-up stay out of the numbers.
+#define BENCH_WARMUP_FRAMES 10
+typedef struct {
+  SampleHistory cpu_frame;
+  SampleHistory frame_wait;
+  SampleHistory acquire;
+  SampleHistory present;
+  SampleHistory record;
+  SampleHistory transform;
+  SampleHistory latency;
+  SampleHistory gpu_render_pass;
+}FrameStats;
+
+FrameStats frame_stats;
+
+typedef struct {
+  double init_vulkan_ms;
+  double pipeline_create_ms;
+  double mesh_load_ms;
+  bool pipeline_cache_warm;
+}StartupTimings;
+
+StartupTimings startup_timings;
+
+#define QUEUE_COUNT 3
 typedef struct {
   long graphics_index;
   long presentation_index;
+  long transfer_index;
 }QueueFamilyIndices;
 
 QueueFamilyIndices queue_indices;
+uint32_t graphics_timestamp_valid_bits;
 
 #define VALIDATION_LAYER_COUNT 1
 const char *validation_layers[VALIDATION_LAYER_COUNT] = {"VK_LAYER_KHRONOS_validation"};
@@ -59,8 +176,10 @@ VkInstance instance;
 VkSurfaceKHR surface;
 VkPhysicalDevice physical_device = VK_NULL_HANDLE;
 VkDevice logical_device;
+MemAllocator allocator;
 VkQueue graphics_queue;
 VkQueue presentation_queue;
+VkQueue transfer_queue;
 VkSurfaceFormatKHR format;
 VkPresentModeKHR present_mode;
 VkSwapchainKHR swap_chain;
@@ -71,48 +190,374 @@ VkFormat swap_chain_img_format;
 VkExtent2D swap_chain_extent;
 VkImageView swap_chain_img_views[MAX_SWAP_CHAIN_IMGS];
 VkFramebuffer swap_chain_framebuffers[MAX_SWAP_CHAIN_IMGS];
+// Headless mode renders into a ring of offscreen images, one per frame in flight, instead of a swap chain.
+#define OFFSCREEN_IMG_FORMAT VK_FORMAT_B8G8R8A8_SRGB
+MemAllocation offscreen_imgs_alloc[MAX_FRAMES_IN_FLIGHT];
 VkRenderPass render_pass;
 VkDescriptorSetLayout desc_set_layout;
 VkPipelineLayout pipeline_layout;
+// The permutation selected with --pipeline, bound for every draw.
 VkPipeline graphics_pipeline;
+
+// Fixed-function variants of the graphics pipeline. All of them are compiled at startup, in
+// parallel on the thread pool, so selecting another one never compiles on the render thread.
+// Every variant uses the loaded mesh's vertex layout.
+typedef struct {
+  const char *name;
+  VkPrimitiveTopology topology;
+  VkCullModeFlags cull_mode;
+  bool blend;
+}PipelinePermutation;
+
+static const PipelinePermutation pipeline_permutations[] = {
+  {"opaque", VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_CULL_MODE_BACK_BIT, false},
+  {"opaque-two-sided", VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_CULL_MODE_NONE, false},
+  {"blended", VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_CULL_MODE_BACK_BIT, true},
+  {"blended-two-sided", VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, VK_CULL_MODE_NONE, true},
+};
+#define PIPELINE_PERMUTATION_COUNT (sizeof(pipeline_permutations) / sizeof(pipeline_permutations[0]))
+
+// One compiled pipeline per entry of pipeline_permutations.
+typedef struct {
+  VkPipeline pipelines[PIPELINE_PERMUTATION_COUNT];
+  double compile_ms[PIPELINE_PERMUTATION_COUNT];
+}PipelineSet;
+
+PipelineSet pipeline_set;
+
+typedef struct {
+  const PipelinePermutation *permutation;
+  VkShaderModule vert_module;
+  VkShaderModule frag_module;
+  VkPipeline pipeline;
+  double compile_ms;
+  WaitGroup *group;
+}PipelineBuildJob;
+
+// With --hot-reload a watcher thread rebuilds the graphics pipelines whenever a .spv file in the
+// shaders directory changes. The result waits in ready until the render loop swaps it in between
+// frames; the replaced pipelines go through the deletion queue.
+#define SHADER_DIR "./shaders"
+typedef struct {
+  FileWatcher watcher;
+  _Atomic(PipelineSet *) ready;
+}ShaderReload;
+
+ShaderReload shader_reload;
+
 VkCommandPool command_pool;
 VkCommandBuffer command_buffers[MAX_FRAMES_IN_FLIGHT];
+
+DrawCmd *draws;
+// Model matrix of every draw, refreshed each frame from the simulation state.
+TransformSoA draw_transforms;
+// Final matrix of every draw for the push constant path, read while recording.
+mat4 *draw_mvps;
+TransformKernel transform_kernel;
+
+// View and projection only change with the camera or the swap chain extent, so their product is
+// cached and rebuilt only when either differs from what it was built for.
+typedef struct {
+  vec3 eye;
+  vec3 center;
+  vec3 up;
+  float fov;
+  float near_plane;
+  float far_plane;
+  bool dirty;
+  VkExtent2D extent;
+  mat4 view_proj;
+  vec4 frustum_planes[6];
+}Camera;
+
+Camera camera = {
+  .eye = {2.0f, 2.0f, 2.0f},
+  .center = {0.0f, 0.0f, 0.0f},
+  .up = {0.0f, 0.0f, 1.0f},
+  .fov = 45.0f,
+  .near_plane = 0.1f,
+  .far_plane = 10.0f,
+  .dirty = true,
+};
+
+// With --gpu-cull a compute pass tests every instance's bounding sphere against the frustum and
+// packs the survivors of each draw into a visible list, counting them in the instanceCount of the
+// draw's VkDrawIndexedIndirectCommand. The vertex shader fetches instances through that list and
+// each draw's MVP from the frame's cull buffer, so a whole record slice is one multi-draw.
+#define CULL_GROUP_SIZE 64
+typedef struct {
+  vec4 sphere;
+  uint32_t draw;
+  uint32_t pad[3];
+}CullObject;
+
+typedef struct {
+  mat4 model;
+  uint32_t first_object;
+  uint32_t pad[3];
+}CullDraw;
+
+// Per frame slot, written by the CPU before every submit. Matches the Frame block in cull.comp.
+// The draws' MVPs follow at cull_mvps_offset for the vertex shader.
+typedef struct {
+  vec4 planes[6];
+  CullDraw draws[];
+}CullFrame;
+
+bool gpu_cull_supported;
+vec4 mesh_bounds;
+VkBuffer cull_object_buffer;
+MemAllocation cull_object_buffer_alloc;
+VkBuffer cull_frame_buffers[MAX_FRAMES_IN_FLIGHT];
+MemAllocation cull_frame_buffers_alloc[MAX_FRAMES_IN_FLIGHT];
+VkDeviceSize cull_mvps_offset;
+// The commands every frame starts from: each draw with no instances, starting at its first object.
+VkBuffer indirect_template_buffer;
+MemAllocation indirect_template_buffer_alloc;
+// Per frame slot: one command per draw at offset 0, the visible list at indirect_visible_offset.
+VkBuffer indirect_buffers[MAX_FRAMES_IN_FLIGHT];
+MemAllocation indirect_buffers_alloc[MAX_FRAMES_IN_FLIGHT];
+VkDeviceSize indirect_visible_offset;
+VkDescriptorSetLayout cull_desc_set_layout;
+VkDescriptorPool cull_desc_pool;
+VkDescriptorSet cull_desc_sets[MAX_FRAMES_IN_FLIGHT];
+VkPipelineLayout cull_pipeline_layout;
+VkPipeline cull_pipeline;
+
+// The draw list is split into contiguous slices, each recorded into its own secondary command buffer
+// on the thread pool. Every slice owns one command pool per frame in flight, so a pool is only ever
+// touched by the single job recording that slice and needs no locking.
+#define MIN_DRAWS_PER_RECORD_SLICE 64
+typedef struct {
+  VkCommandPool pools[MAX_FRAMES_IN_FLIGHT];
+  VkCommandBuffer cmds[MAX_FRAMES_IN_FLIGHT];
+  uint32_t first_draw;
+  uint32_t draw_count;
+  uint32_t framebuffer_index;
+}RecordSlice;
+
+RecordSlice *record_slices;
+uint32_t record_slice_count;
+WaitGroup record_done;
+
+// With --cache-commands the command stream is recorded once per frame slot and swap chain image and
+// replayed until something it references changes. Bumping the generation marks every cached buffer
+// stale; each one is re-recorded the next time its frame slot comes around, after its timeline wait.
+VkCommandBuffer cached_command_buffers[MAX_FRAMES_IN_FLIGHT][MAX_SWAP_CHAIN_IMGS];
+uint64_t cached_command_generations[MAX_FRAMES_IN_FLIGHT][MAX_SWAP_CHAIN_IMGS];
+uint64_t record_slice_generations[MAX_FRAMES_IN_FLIGHT];
+uint64_t command_cache_generation = 1;
 VkSemaphore img_available_semaphores[MAX_FRAMES_IN_FLIGHT];
 VkSemaphore render_finished_semaphores[MAX_FRAMES_IN_FLIGHT];
-VkFence in_flight_fences[MAX_FRAMES_IN_FLIGHT];
+// Every graphics queue submission that retires work signals this timeline with its serial, so waiting
+// for a frame slot, an upload batch or staging space is waiting for the counter to reach a value.
+VkSemaphore timeline_semaphore;
+Mesh mesh;
 VkBuffer vertex_buffer;
-VkDeviceMemory vertex_buffer_mem;
+MemAllocation vertex_buffer_alloc;
 VkBuffer index_buffer;
-VkDeviceMemory index_buffer_mem;
+MemAllocation index_buffer_alloc;
 bool framebuffer_resized = false;
-VkBuffer uniform_buffers[MAX_FRAMES_IN_FLIGHT];
-VkDeviceMemory uniform_buffers_mem[MAX_FRAMES_IN_FLIGHT];
-void * uniform_buffers_mapped[MAX_FRAMES_IN_FLIGHT];
+// One persistently mapped uniform buffer holds a UniformBufferObject for every draw in every frame
+// slot. Frame slot f owns [f * frame_size, (f + 1) * frame_size) and reuses it once the timeline has
+// reached the slot's serial. Draws select their slice with a dynamic offset into a single descriptor set.
+typedef struct {
+  VkBuffer buffer;
+  MemAllocation alloc;
+  VkDeviceSize stride;
+  VkDeviceSize frame_size;
+}UniformRing;
+
+UniformRing uniform_ring;
+
+// Instance data is kept on the CPU and copied into the frame's buffer whenever that copy is stale,
+// so the CPU never writes a buffer the GPU may still be reading.
+InstanceData *instances;
+VkBuffer instance_buffers[MAX_FRAMES_IN_FLIGHT];
+MemAllocation instance_buffers_alloc[MAX_FRAMES_IN_FLIGHT];
+bool instance_buffers_dirty[MAX_FRAMES_IN_FLIGHT];
 VkDescriptorPool desc_pool;
 VkDescriptorSet desc_sets[MAX_FRAMES_IN_FLIGHT];
 uint32_t current_frame = 0;
 
+// Every submission to the graphics queue that consumes staging memory gets a serial, which it signals on
+// timeline_semaphore. Reaching a value retires that serial and, because the queue executes in submission
+// order, every serial before it.
+uint64_t submitted_serial = 0;
+uint64_t completed_serial = 0;
+uint64_t frame_serials[MAX_FRAMES_IN_FLIGHT];
+// Objects that the GPU may still be using when they are released. Each entry records the latest
+// submitted serial at the time it was queued and is destroyed once that serial has completed, so
+// unloading or replacing a resource at runtime never needs vkDeviceWaitIdle. Serials only grow,
+// so the queue is retired strictly from the front.
+typedef enum {
+  DELETION_SWAPCHAIN,
+  DELETION_IMAGE_VIEW,
+  DELETION_FRAMEBUFFER,
+  DELETION_BUFFER,
+  DELETION_IMAGE,
+  DELETION_MEMORY,
+  DELETION_PIPELINE,
+  DELETION_PIPELINE_LAYOUT,
+  DELETION_DESCRIPTOR_POOL,
+}DeletionKind;
+
+typedef struct {
+  DeletionKind kind;
+  uint64_t serial;
+  union {
+    VkSwapchainKHR swap_chain;
+    VkImageView img_view;
+    VkFramebuffer framebuffer;
+    struct {
+      VkBuffer handle;
+      MemAllocation alloc;
+    }buffer;
+    struct {
+      VkImage handle;
+      MemAllocation alloc;
+    }image;
+    MemAllocation memory;
+    VkPipeline pipeline;
+    VkPipelineLayout pipeline_layout;
+    VkDescriptorPool desc_pool;
+  };
+}PendingDeletion;
+
+typedef struct {
+  PendingDeletion *items;
+  uint32_t first;
+  uint32_t count;
+  uint32_t capacity;
+}DeletionQueue;
+
+DeletionQueue deletion_queue;
+
+// Frames whose completion has not been observed yet, by frame slot, for the latency report. A
+// serial of 0 means the slot has nothing pending.
+typedef struct {
+  uint64_t serial;
+  double start_ms;
+}PendingLatency;
+
+PendingLatency pending_latencies[MAX_FRAMES_IN_FLIGHT];
+
+// All host to device copies are staged in one persistently mapped ring. Allocations are handed out
+// from the head; a marker records the head at each submission and the tail advances past a marker
+// once its serial has retired. Offsets are virtual and only wrapped when the ring is indexed.
+#define STAGING_RING_SIZE (32ull * 1024 * 1024)
+#define STAGING_RING_ALIGNMENT 16
+#define STAGING_RING_MAX_MARKERS 64
+typedef struct {
+  VkDeviceSize head;
+  uint64_t serial;
+}StagingMarker;
+
+typedef struct {
+  VkBuffer buffer;
+  MemAllocation alloc;
+  VkDeviceSize size;
+  VkDeviceSize head;
+  VkDeviceSize tail;
+  VkDeviceSize marked_head;
+  StagingMarker markers[STAGING_RING_MAX_MARKERS];
+  uint32_t marker_first;
+  uint32_t marker_count;
+}StagingRing;
+
+StagingRing staging_ring;
+
+// Uploads are recorded into a batch and submitted together, on the dedicated transfer queue
+// when the device has one. A batch is retired once the timeline reaches its serial, without idling any queue.
+#define UPLOAD_BATCH_COUNT 4
+typedef struct {
+  VkCommandBuffer transfer_cmd;
+  VkCommandBuffer acquire_cmd;
+  bool recording;
+  bool pending;
+  uint64_t serial;
+  VkPipelineStageFlags dst_stages;
+  VkBufferMemoryBarrier *barriers;
+  uint32_t barrier_count;
+  uint32_t barrier_capacity;
+}UploadBatch;
+
+VkCommandPool upload_command_pool;
+// The transfer queue signals its own timeline, which the ownership acquire on the graphics queue waits on.
+VkSemaphore transfer_timeline;
+uint64_t transfer_timeline_value = 0;
+UploadBatch upload_batches[UPLOAD_BATCH_COUNT];
+uint32_t current_upload_batch = 0;
+#define PIPELINE_CACHE_PATH "./pipeline_cache.bin"
+VkPipelineCache pipeline_cache;
+// Two timestamps per frame slot, written around the render pass.
+#define TIMESTAMPS_PER_FRAME 2
+VkQueryPool timestamp_query_pool = VK_NULL_HANDLE;
+float timestamp_period_ns;
+bool timestamps_pending[MAX_FRAMES_IN_FLIGHT];
+volatile sig_atomic_t quit_requested = 0;
+
 static bool check_for_validation_layers();
 static void create_instance();
 static void create_surface();
 static void select_physical_device();
+static void find_queue_indices(VkPhysicalDevice device);
 static void create_logical_device();
-static void create_swap_chain();
+static void create_swap_chain(VkSwapchainKHR old_swap_chain);
 static void create_img_views();
 static void create_render_pass();
 static void create_desc_set_layout();
+static void create_pipeline_cache();
+static void save_pipeline_cache();
 static void create_graphics_pipeline();
+static bool build_pipeline_set(AssetView vert_source, AssetView frag_source, ThreadPool *pool, PipelineSet *set);
+static void destroy_pipeline_set(PipelineSet *set);
+static void start_shader_reload();
+static void apply_shader_reload();
+static void stop_shader_reload();
 static void create_framebuffers();
+static void create_offscreen_targets();
 static void create_command_buffers();
+static void invalidate_command_cache();
+static VkCommandBuffer frame_command_buffer(uint32_t img_index);
+static void build_draw_list();
+static void create_record_slices();
 static void create_command_pool();
-static void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage_flags, VkMemoryPropertyFlags mem_flags, VkBuffer *buffer, VkDeviceMemory *buffer_mem);
+static void create_staging_ring();
+static void observe_frame_completions();
+static const char *present_mode_name(VkPresentModeKHR mode);
+static void retire_serial(uint64_t serial);
+static void staging_ring_mark(uint64_t serial);
+static void create_upload_context();
+static void upload_buffer(VkBuffer dst_buffer, const void *data, VkDeviceSize size, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access);
+static void upload_flush();
+static void upload_poll();
+static void destroy_upload_context();
+static void create_timestamp_query_pool();
+static void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage_flags, VkMemoryPropertyFlags mem_flags, VkBuffer *buffer, MemAllocation *buffer_alloc);
 static void create_vertex_buffer();
+static void request_startup_assets();
+static void load_mesh();
+static VkFormat mesh_attrib_vk_format(uint32_t format);
 static void create_index_buffer();
 static void create_uniform_buffers();
+static uint32_t uniform_ring_offset(uint32_t frame, uint32_t draw);
+static void create_instance_buffers();
+static void update_instance_buffer(uint32_t current_frame);
 static void create_desc_pool();
 static void create_desc_sets();
 static void create_sync_prims();
+static void create_timeline_semaphore(VkSemaphore *semaphore);
+static void create_cull_pipeline();
+static void create_cull_buffers();
+static void create_cull_desc_sets();
+static void update_cull_frame(uint32_t current_frame);
+static void record_cull(VkCommandBuffer command_buffer);
+static void wait_for_serial(uint64_t serial);
+static void poll_timeline();
 static void recreate_swap_chain();
+static void flush_deletions(bool all);
+static void defer_destroy_pipeline(VkPipeline pipeline);
 static void cleanup_swap_chain();
 static void handle_framebuffer_resize(GLFWwindow*, int, int);
 
@@ -131,24 +576,89 @@ void init_window()
 
 void init_vulkan()
 {
+  double init_start = time_now_ms();
+  request_startup_assets();
   create_instance();
-  create_surface();
+  if (!config.headless) {
+    create_surface();
+  }
   select_physical_device();
   create_logical_device();
-  create_swap_chain();
-  create_img_views();
+  if (!config.headless) {
+    create_swap_chain(VK_NULL_HANDLE);
+    create_img_views();
+  } else {
+    swap_chain_img_format = OFFSCREEN_IMG_FORMAT;
+    swap_chain_extent = (VkExtent2D) {.width = WIDTH, .height = HEIGHT};
+  }
   create_render_pass();
   create_desc_set_layout();
+  load_mesh();
+  create_pipeline_cache();
+  double pipeline_start = time_now_ms();
   create_graphics_pipeline();
-  create_framebuffers();
+  if (config.gpu_cull) {
+    create_cull_pipeline();
+  }
+  startup_timings.pipeline_create_ms = time_now_ms() - pipeline_start;
+  if (!config.headless) {
+    create_framebuffers();
+  } else {
+    create_offscreen_targets();
+  }
   create_command_pool();
+  create_sync_prims();
+  create_staging_ring();
+  create_upload_context();
+  double mesh_start = time_now_ms();
+  if (config.gpu_cull) {
+    mesh_bounding_sphere(&mesh, mesh_bounds);
+  }
   create_vertex_buffer();
   create_index_buffer();
+  // Both sections are in the staging ring now, the file is no longer needed.
+  mesh_close(&mesh);
+  startup_timings.mesh_load_ms = time_now_ms() - mesh_start;
+  upload_flush();
+  build_draw_list();
   create_uniform_buffers();
+  create_instance_buffers();
+  if (config.gpu_cull) {
+    create_cull_buffers();
+  }
   create_desc_pool();
   create_desc_sets();
+  if (config.gpu_cull) {
+    create_cull_desc_sets();
+  }
   create_command_buffers();
-  create_sync_prims();
+  create_record_slices();
+  create_timestamp_query_pool();
+  startup_timings.init_vulkan_ms = time_now_ms() - init_start;
+
+  fprintf(stderr, "INFO: init_vulkan took %.2f ms, pipelines %.2f ms (%s pipeline cache), mesh upload %.2f ms\n",
+	  startup_timings.init_vulkan_ms, startup_timings.pipeline_create_ms,
+	  startup_timings.pipeline_cache_warm ? "warm" : "cold", startup_timings.mesh_load_ms);
+  for (uint32_t i = 0; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+    fprintf(stderr, "INFO:   %s compiled in %.2f ms\n", pipeline_permutations[i].name, pipeline_set.compile_ms[i]);
+  }
+}
+
+void request_startup_assets()
+{
+  asset_request(&thread_pool, &startup_assets.vert_shader, VERT_SHADER_PATH);
+  asset_request(&thread_pool, &startup_assets.frag_shader, FRAG_SHADER_PATH);
+  if (config.gpu_cull) {
+    asset_request(&thread_pool, &startup_assets.cull_shader, CULL_SHADER_PATH);
+  }
+  // A missing pipeline cache is the normal cold start, not an error.
+  startup_assets.pipeline_cache_requested = access(PIPELINE_CACHE_PATH, R_OK) == 0;
+  if (startup_assets.pipeline_cache_requested) {
+    asset_request(&thread_pool, &startup_assets.pipeline_cache, PIPELINE_CACHE_PATH);
+  }
+  if (config.mesh_path != NULL) {
+    asset_request(&thread_pool, &startup_assets.mesh, config.mesh_path);
+  }
 }
 
 void create_instance()
@@ -166,12 +676,14 @@ void create_instance()
     .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
     .pEngineName = "",
     .engineVersion = VK_MAKE_VERSION(1, 0, 0),
-    .apiVersion = VK_API_VERSION_1_0,
+    .apiVersion = VK_API_VERSION_1_2,
   };
 
   uint32_t glfw_extension_count = 0;
-  const char** glfw_extensions;
-  glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+  const char** glfw_extensions = NULL;
+  if (!config.headless) {
+    glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+  }
 
   VkInstanceCreateInfo create_info = {
     .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -216,11 +728,46 @@ void select_physical_device()
 
   //TODO: add options to select a different GPU, I only have one so this doesnt matter.
   physical_device = devices[0];
+
+  // Frame pacing, uploads and resource retirement are all driven by timeline semaphores.
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  VkPhysicalDeviceVulkan12Features features_12 = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+  };
+  VkPhysicalDeviceFeatures2 features = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+    .pNext = &features_12,
+  };
+  if (properties.apiVersion >= VK_API_VERSION_1_2) {
+    vkGetPhysicalDeviceFeatures2(physical_device, &features);
+  }
+  if (!features_12.timelineSemaphore) {
+    fprintf(stderr, "ERROR: GPU does not support Vulkan 1.2 timeline semaphores\n");
+    exit(1);
+  }
+
+  // The culling pass writes a non-zero firstInstance per command, and a record slice draws all of
+  // its commands with one call, which is a multi-draw as soon as there is more than one draw.
+  gpu_cull_supported = features.features.drawIndirectFirstInstance &&
+    (config.draw_count <= 1 || features.features.multiDrawIndirect) &&
+    config.draw_count <= properties.limits.maxDrawIndirectCount;
+  if (config.gpu_cull && !gpu_cull_supported) {
+    fprintf(stderr, "WARNING: GPU lacks drawIndirectFirstInstance, multiDrawIndirect or a maxDrawIndirectCount of %u, --gpu-cull is ignored\n",
+	    config.draw_count);
+    config.gpu_cull = false;
+    asset_wait(&startup_assets.cull_shader);
+    asset_release(&startup_assets.cull_shader.view);
+  }
+
+  find_queue_indices(physical_device);
 }
 
-void find_queue_indices(VkPhysicalDevice device) {
+void find_queue_indices(VkPhysicalDevice device)
+{
   queue_indices = (QueueFamilyIndices) {.graphics_index = -1,
-					.presentation_index = -1};
+					.presentation_index = -1,
+					.transfer_index = -1};
   uint32_t queue_family_count = 0;
   vkGetPhysicalDeviceQueueFamilyProperties(device, &queue_family_count, NULL);
 
@@ -230,15 +777,35 @@ void find_queue_indices(VkPhysicalDevice device) {
   for (uint32_t i = 0; i < queue_family_count; ++i) {
     if (queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
       queue_indices.graphics_index = i;
+      graphics_timestamp_valid_bits = queue_families[i].timestampValidBits;
+    }
+
+    // A transfer-only family usually maps to the copy engines and runs alongside graphics work.
+    if ((queue_families[i].queueFlags & VK_QUEUE_TRANSFER_BIT) &&
+	!(queue_families[i].queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+      queue_indices.transfer_index = i;
+    }
+
+    // Nothing is presented in headless mode, so the graphics queue stands in for presentation.
+    if (config.headless) {
+      continue;
     }
 
     VkBool32 presentation_support = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR(physical_device, i, surface, &presentation_support);
+    vkGetPhysicalDeviceSurfaceSupportKHR(device, i, surface, &presentation_support);
 
     if (presentation_support) {
       queue_indices.presentation_index = i;
     }
   }
+
+  if (config.headless) {
+    queue_indices.presentation_index = queue_indices.graphics_index;
+  }
+
+  if (queue_indices.transfer_index < 0) {
+    queue_indices.transfer_index = queue_indices.graphics_index;
+  }
 }
 
 void create_logical_device()
@@ -253,7 +820,7 @@ void create_logical_device()
     exit(1);
   }
   
-  long indices[QUEUE_COUNT] = {queue_indices.graphics_index, queue_indices.presentation_index};
+  long indices[QUEUE_COUNT] = {queue_indices.graphics_index, queue_indices.presentation_index, queue_indices.transfer_index};
   VkDeviceQueueCreateInfo queue_create_infos[QUEUE_COUNT];
   uint32_t queue_count = 0;
   float queue_priority = 1.0f;
@@ -267,22 +834,30 @@ void create_logical_device()
 
     bool unique = true;
     for (size_t j = 0; j < i; ++j) {
-      if (queue_create_infos[j].queueFamilyIndex == indices[i]) {
+      if (indices[j] == indices[i]) {
 	unique = false;
 	break;
       }
     }
 
     if (unique) {
-      queue_create_infos[i] = queue_create_info;
+      queue_create_infos[queue_count] = queue_create_info;
       ++queue_count;
     }
   }
 
-  VkPhysicalDeviceFeatures device_features = {0};
+  VkPhysicalDeviceFeatures device_features = {
+    .multiDrawIndirect = config.gpu_cull ? VK_TRUE : VK_FALSE,
+    .drawIndirectFirstInstance = config.gpu_cull ? VK_TRUE : VK_FALSE,
+  };
+  VkPhysicalDeviceVulkan12Features features_12 = {
+    .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES,
+    .timelineSemaphore = VK_TRUE,
+  };
 
   VkDeviceCreateInfo create_info = {
     .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+    .pNext = &features_12,
     .queueCreateInfoCount = queue_count,
     .pQueueCreateInfos = queue_create_infos,
     .pEnabledFeatures = &device_features,
@@ -292,7 +867,7 @@ void create_logical_device()
 #else
     .enabledLayerCount = 0,
 #endif
-    .enabledExtensionCount = DEVICE_EXTENSION_COUNT,
+    .enabledExtensionCount = config.headless ? 0 : DEVICE_EXTENSION_COUNT,
     .ppEnabledExtensionNames = device_extensions,
   };
 
@@ -301,6 +876,9 @@ void create_logical_device()
   }
   vkGetDeviceQueue(logical_device, queue_indices.graphics_index, 0, &graphics_queue);
   vkGetDeviceQueue(logical_device, queue_indices.presentation_index, 0, &presentation_queue);
+  vkGetDeviceQueue(logical_device, queue_indices.transfer_index, 0, &transfer_queue);
+
+  mem_allocator_init(&allocator, physical_device, logical_device);
 }
 
 VkExtent2D choose_swap_extent(const VkSurfaceCapabilitiesKHR *capabilities)
@@ -335,16 +913,21 @@ VkSurfaceFormatKHR choose_swap_format(VkSurfaceFormatKHR *formats, uint32_t form
 }
 
 VkPresentModeKHR choose_swap_present_mode(VkPresentModeKHR *present_modes, uint32_t present_modes_count) {
+  VkPresentModeKHR wanted = config.present_mode_set ? config.present_mode : VK_PRESENT_MODE_MAILBOX_KHR;
   for (uint32_t i = 0; i < present_modes_count; ++i) {
-    if (present_modes[i] == VK_PRESENT_MODE_MAILBOX_KHR) {
+    if (present_modes[i] == wanted) {
       return present_modes[i];
     }
   }
 
+  // FIFO is the only mode every implementation has to support.
+  if (config.present_mode_set) {
+    fprintf(stderr, "WARNING: Present mode %s is not supported, using fifo\n", present_mode_name(wanted));
+  }
   return VK_PRESENT_MODE_FIFO_KHR;
 }
 
-void create_swap_chain()
+void create_swap_chain(VkSwapchainKHR old_swap_chain)
 {
   VkSurfaceCapabilitiesKHR capabilities;
   vkGetPhysicalDeviceSurfaceCapabilitiesKHR(physical_device, surface, &capabilities);
@@ -365,8 +948,17 @@ void create_swap_chain()
   format = choose_swap_format(formats, format_count);
   present_mode = choose_swap_present_mode(present_modes, present_modes_count);
 
-  // TODO: make this higer?
-  uint32_t img_count = capabilities.minImageCount + 1;
+  uint32_t img_count = config.swapchain_images ? config.swapchain_images : capabilities.minImageCount + 1;
+  uint32_t max_img_count = capabilities.maxImageCount ? capabilities.maxImageCount : MAX_SWAP_CHAIN_IMGS;
+  if (max_img_count > MAX_SWAP_CHAIN_IMGS) {
+    max_img_count = MAX_SWAP_CHAIN_IMGS;
+  }
+  if (img_count < capabilities.minImageCount || img_count > max_img_count) {
+    uint32_t clamped = clamp_u32(img_count, capabilities.minImageCount, max_img_count);
+    fprintf(stderr, "WARNING: %u swap chain images requested, the surface supports %u to %u, using %u\n",
+	    img_count, capabilities.minImageCount, max_img_count, clamped);
+    img_count = clamped;
+  }
   uint32_t queue_family_indices[] = {queue_indices.graphics_index, queue_indices.presentation_index};
   VkSwapchainCreateInfoKHR create_info = {
     .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
@@ -381,7 +973,7 @@ void create_swap_chain()
     .compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR,
     .presentMode = present_mode,
     .clipped = VK_TRUE,
-    .oldSwapchain = VK_NULL_HANDLE,
+    .oldSwapchain = old_swap_chain,
   };
   
   if (queue_indices.graphics_index != queue_indices.presentation_index) {
@@ -397,8 +989,12 @@ void create_swap_chain()
     exit(1);
   }
 
+  // The implementation may create more images than requested.
   vkGetSwapchainImagesKHR(logical_device, swap_chain, &img_count, NULL);
-  assert(img_count < MAX_SWAP_CHAIN_IMGS);
+  if (img_count > MAX_SWAP_CHAIN_IMGS) {
+    fprintf(stderr, "ERROR: Swap chain has %u images, at most %u are supported\n", img_count, MAX_SWAP_CHAIN_IMGS);
+    exit(1);
+  }
   vkGetSwapchainImagesKHR(logical_device, swap_chain, &img_count, &swap_chain_imgs[0]);
 
   swap_chain_img_format = format.format;
@@ -443,7 +1039,7 @@ void create_render_pass()
     .stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE,
     .stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE,
     .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-    .finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+    .finalLayout = config.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
   };
 
   VkAttachmentReference color_attachment_ref = {
@@ -482,19 +1078,24 @@ void create_render_pass()
   }
 }
 
+// The UBO, then the visible list, instances and draw MVPs read by culled draws, in the order
+// shader.vert declares them.
 void create_desc_set_layout()
 {
-  VkDescriptorSetLayoutBinding ubo_layout = {
-    .binding = 0,
-    .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-    .descriptorCount = 1,
-    .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
-  };
+  VkDescriptorSetLayoutBinding bindings[4];
+  for (uint32_t i = 0; i < 4; ++i) {
+    bindings[i] = (VkDescriptorSetLayoutBinding) {
+      .binding = i,
+      .descriptorType = i == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 1,
+      .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+    };
+  }
 
   VkDescriptorSetLayoutCreateInfo layout_info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-    .bindingCount = 1,
-    .pBindings = &ubo_layout,
+    .bindingCount = 4,
+    .pBindings = bindings,
   };
 
   if (vkCreateDescriptorSetLayout(logical_device, &layout_info, NULL, &desc_set_layout) != VK_SUCCESS) {
@@ -504,76 +1105,197 @@ void create_desc_set_layout()
 
 }
 
-void create_graphics_pipeline()
+bool pipeline_cache_matches_device(const void *data, size_t size)
 {
-  FileInfo vert_source = get_file_info("./shaders/vert.spv");
-  FileInfo frag_source = get_file_info("./shaders/frag.spv");
+  VkPipelineCacheHeaderVersionOne header;
+  if (size < sizeof(header)) {
+    return false;
+  }
+  memcpy(&header, data, sizeof(header));
 
-  VkShaderModuleCreateInfo create_info = {
-    .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-    .codeSize = vert_source.size,
-    .pCode = (const uint32_t*) vert_source.content,
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+
+  return header.headerSize >= sizeof(header) &&
+    header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+    header.vendorID == properties.vendorID &&
+    header.deviceID == properties.deviceID &&
+    memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+void create_pipeline_cache()
+{
+  AssetView cache_view = {0};
+  if (startup_assets.pipeline_cache_requested && asset_wait(&startup_assets.pipeline_cache)) {
+    cache_view = startup_assets.pipeline_cache.view;
+  }
+
+  // A cache written by another driver or GPU is ignored rather than handed to the driver.
+  if (cache_view.data != NULL && !pipeline_cache_matches_device(cache_view.data, cache_view.size)) {
+    fprintf(stderr, "WARNING: Ignoring pipeline cache %s built for a different device or driver\n", PIPELINE_CACHE_PATH);
+    asset_release(&cache_view);
+  }
+
+  VkPipelineCacheCreateInfo cache_info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+    .initialDataSize = cache_view.size,
+    .pInitialData = cache_view.data,
   };
-  
-  VkShaderModule vert_module;
-  if (vkCreateShaderModule(logical_device, &create_info, NULL, &vert_module) != VK_SUCCESS) {
-    fprintf(stderr, "ERROR: Could not create vertex shader module\n");
+
+  if (vkCreatePipelineCache(logical_device, &cache_info, NULL, &pipeline_cache) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to create pipeline cache\n");
     exit(1);
   }
 
-  create_info.codeSize = frag_source.size;
-  create_info.pCode = (const uint32_t*) frag_source.content;
+  startup_timings.pipeline_cache_warm = cache_view.data != NULL;
+  asset_release(&cache_view);
+}
 
-  VkShaderModule frag_module;
-  if (vkCreateShaderModule(logical_device, &create_info, NULL, &frag_module) != VK_SUCCESS) {
-    fprintf(stderr, "ERROR: Could not create fragment shader module\n");
+void save_pipeline_cache()
+{
+  size_t size = 0;
+  if (vkGetPipelineCacheData(logical_device, pipeline_cache, &size, NULL) != VK_SUCCESS || size == 0) {
+    return;
+  }
+
+  void *data = malloc(size);
+  if (data == NULL) {
+    fprintf(stderr, "WARNING: Could not allocate pipeline cache data\n");
+    return;
+  }
+
+  if (vkGetPipelineCacheData(logical_device, pipeline_cache, &size, data) == VK_SUCCESS) {
+    write_file_atomic(PIPELINE_CACHE_PATH, data, size);
+  }
+  free(data);
+}
+
+void create_graphics_pipeline()
+{
+  VkPushConstantRange push_range = {
+    .stageFlags = VK_SHADER_STAGE_VERTEX_BIT,
+    .offset = 0,
+    .size = sizeof(PushConstants),
+  };
+
+  VkPipelineLayoutCreateInfo pipeline_layout_info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    .setLayoutCount = 1,
+    .pSetLayouts = &desc_set_layout,
+    .pushConstantRangeCount = 1,
+    .pPushConstantRanges = &push_range,
+  };
+
+  if (vkCreatePipelineLayout(logical_device, &pipeline_layout_info, NULL, &pipeline_layout) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Could not create graphics pipeline layout\n");
+    exit(1);
+  }
+
+  if (!asset_wait(&startup_assets.vert_shader) || !asset_wait(&startup_assets.frag_shader)) {
+    fprintf(stderr, "ERROR: Could not load shaders\n");
     exit(1);
   }
+  bool built = build_pipeline_set(startup_assets.vert_shader.view, startup_assets.frag_shader.view, &thread_pool, &pipeline_set);
+  asset_release(&startup_assets.vert_shader.view);
+  asset_release(&startup_assets.frag_shader.view);
+  if (!built) {
+    exit(1);
+  }
+  graphics_pipeline = pipeline_set.pipelines[config.pipeline];
+}
+
+static bool is_spirv(AssetView source)
+{
+  return source.size >= 5 * sizeof(uint32_t) && source.size % sizeof(uint32_t) == 0 && *(const uint32_t *) source.data == 0x07230203u;
+}
+
+// Compiles one permutation. Runs on the thread pool at startup and on the watcher thread for a
+// reload; everything it reads is fixed after startup.
+static void build_permutation_job(void *arg)
+{
+  PipelineBuildJob *job = arg;
+  const PipelinePermutation *permutation = job->permutation;
+  double start = time_now_ms();
+
+  // All transform paths share one shader; the branches are resolved when the pipeline is compiled.
+  VkBool32 spec_values[2] = {
+    config.push_constants ? VK_TRUE : VK_FALSE,
+    config.gpu_cull ? VK_TRUE : VK_FALSE,
+  };
+  VkSpecializationMapEntry spec_entries[2] = {
+    {.constantID = SPEC_CONSTANT_PUSH_MODEL, .offset = 0, .size = sizeof(VkBool32)},
+    {.constantID = SPEC_CONSTANT_GPU_CULL, .offset = sizeof(VkBool32), .size = sizeof(VkBool32)},
+  };
+
+  VkSpecializationInfo spec_info = {
+    .mapEntryCount = 2,
+    .pMapEntries = spec_entries,
+    .dataSize = sizeof(spec_values),
+    .pData = spec_values,
+  };
 
   VkPipelineShaderStageCreateInfo vert_shader_stage_info = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
     .stage = VK_SHADER_STAGE_VERTEX_BIT,
-    .module = vert_module,
+    .module = job->vert_module,
     .pName = "main",
+    .pSpecializationInfo = &spec_info,
   };
 
   VkPipelineShaderStageCreateInfo frag_shader_stage_info = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
     .stage = VK_SHADER_STAGE_FRAGMENT_BIT,
-    .module = frag_module,
+    .module = job->frag_module,
     .pName = "main",
   };
 
   VkPipelineShaderStageCreateInfo shader_stages[] = {vert_shader_stage_info, frag_shader_stage_info};
 
-  VkVertexInputBindingDescription binding_desc = {
-    .binding = 0,
-    .stride = sizeof(Vertex),
-    .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+  // Binding 0 is laid out as described by the mesh file, binding 1 advances once per instance.
+  VkVertexInputBindingDescription binding_desc[2] = {
+    {
+      .binding = 0,
+      .stride = mesh.header.vertex_stride,
+      .inputRate = VK_VERTEX_INPUT_RATE_VERTEX,
+    },
+    {
+      .binding = 1,
+      .stride = sizeof(InstanceData),
+      .inputRate = VK_VERTEX_INPUT_RATE_INSTANCE,
+    },
   };
 
-  VkVertexInputAttributeDescription attrib_desc[2] = {0};
-  attrib_desc[0].binding = 0;
-  attrib_desc[0].location = 0;
-  attrib_desc[0].format = VK_FORMAT_R32G32_SFLOAT;
-  attrib_desc[0].offset = 0;
- 
-  attrib_desc[1].binding = 0;
-  attrib_desc[1].location = 1;
-  attrib_desc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-  attrib_desc[1].offset = sizeof(float) * 2;
+  VkVertexInputAttributeDescription attrib_desc[MESH_MAX_ATTRIBS + 5] = {0};
+  uint32_t attrib_count = 0;
+  for (uint32_t i = 0; i < mesh.header.attrib_count; ++i, ++attrib_count) {
+    attrib_desc[attrib_count].binding = 0;
+    attrib_desc[attrib_count].location = mesh.header.attribs[i].location;
+    attrib_desc[attrib_count].format = mesh_attrib_vk_format(mesh.header.attribs[i].format);
+    attrib_desc[attrib_count].offset = mesh.header.attribs[i].offset;
+  }
+  for (uint32_t column = 0; column < 4; ++column, ++attrib_count) {
+    attrib_desc[attrib_count].binding = 1;
+    attrib_desc[attrib_count].location = INSTANCE_ATTRIB_LOCATION + column;
+    attrib_desc[attrib_count].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    attrib_desc[attrib_count].offset = offsetof(InstanceData, model) + sizeof(vec4) * column;
+  }
+  attrib_desc[attrib_count].binding = 1;
+  attrib_desc[attrib_count].location = INSTANCE_ATTRIB_LOCATION + 4;
+  attrib_desc[attrib_count].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+  attrib_desc[attrib_count].offset = offsetof(InstanceData, color);
+  ++attrib_count;
  
   VkPipelineVertexInputStateCreateInfo vert_input_info = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO,
-    .vertexBindingDescriptionCount = 1,
-    .pVertexBindingDescriptions = &binding_desc,
-    .vertexAttributeDescriptionCount = 2,
+    .vertexBindingDescriptionCount = 2,
+    .pVertexBindingDescriptions = binding_desc,
+    .vertexAttributeDescriptionCount = attrib_count,
     .pVertexAttributeDescriptions = attrib_desc,
   };
 
   VkPipelineInputAssemblyStateCreateInfo input_assembly = {
     .sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO,
-    .topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST,
+    .topology = permutation->topology,
     .primitiveRestartEnable = VK_FALSE,
   };
 
@@ -589,7 +1311,7 @@ void create_graphics_pipeline()
     .rasterizerDiscardEnable = VK_FALSE,
     .polygonMode = VK_POLYGON_MODE_FILL,
     .lineWidth = 1.0f,
-    .cullMode = VK_CULL_MODE_BACK_BIT,
+    .cullMode = permutation->cull_mode,
     .frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE,
     .depthBiasEnable = VK_FALSE,
   };
@@ -600,9 +1322,16 @@ void create_graphics_pipeline()
     .rasterizationSamples = VK_SAMPLE_COUNT_1_BIT,
   };
 
+  // Straight alpha blending for the blended permutations.
   VkPipelineColorBlendAttachmentState color_blend_attachment = {
     .colorWriteMask = VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT,
-    .blendEnable = VK_FALSE,
+    .blendEnable = permutation->blend ? VK_TRUE : VK_FALSE,
+    .srcColorBlendFactor = VK_BLEND_FACTOR_SRC_ALPHA,
+    .dstColorBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+    .colorBlendOp = VK_BLEND_OP_ADD,
+    .srcAlphaBlendFactor = VK_BLEND_FACTOR_ONE,
+    .dstAlphaBlendFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA,
+    .alphaBlendOp = VK_BLEND_OP_ADD,
   };
 
   VkPipelineColorBlendStateCreateInfo color_blend_info = {
@@ -628,17 +1357,6 @@ void create_graphics_pipeline()
     .pDynamicStates = &dynamic_states[0],
   };
 
-  VkPipelineLayoutCreateInfo pipeline_layout_info = {
-    .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-    .setLayoutCount = 1,
-    .pSetLayouts = &desc_set_layout,
-  };
-
-  if (vkCreatePipelineLayout(logical_device, &pipeline_layout_info, NULL, &pipeline_layout) != VK_SUCCESS) {
-    fprintf(stderr, "ERROR: Could not create graphics pipeline layout\n");
-    exit(1);
-  }
-
   VkGraphicsPipelineCreateInfo pipeline_info = {
     .sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO,
     .stageCount = 2,
@@ -655,88 +1373,498 @@ void create_graphics_pipeline()
     .subpass = 0,
   };
 
-  if (vkCreateGraphicsPipelines(logical_device, VK_NULL_HANDLE, 1, &pipeline_info, NULL, &graphics_pipeline) != VK_SUCCESS) {
-    fprintf(stderr, "ERROR: Could not create graphics pipeline\n");
-    exit(1);
+  // The pipeline cache is internally synchronized, so the permutations compile through it concurrently.
+  if (vkCreateGraphicsPipelines(logical_device, pipeline_cache, 1, &pipeline_info, NULL, &job->pipeline) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Could not create graphics pipeline %s\n", permutation->name);
+    job->pipeline = VK_NULL_HANDLE;
+  }
+  job->compile_ms = time_now_ms() - start;
+  if (job->group != NULL) {
+    wait_group_done(job->group);
   }
-
-  vkDestroyShaderModule(logical_device, frag_module, NULL);
-  vkDestroyShaderModule(logical_device, vert_module, NULL);
 }
 
-void create_framebuffers()
+void destroy_pipeline_set(PipelineSet *set)
 {
-  for (size_t i = 0; i < swap_chain_img_count; ++i) {
-    VkImageView attachments[] = {
-      swap_chain_img_views[i]
-    };
-
-    VkFramebufferCreateInfo frame_buffer_info = {
-      .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
-      .renderPass = render_pass,
-      .attachmentCount = 1,
-      .pAttachments = attachments,
-      .width = swap_chain_extent.width,
-      .height = swap_chain_extent.height,
-      .layers = 1,
-    };
-
-    if (vkCreateFramebuffer(logical_device, &frame_buffer_info, NULL, &swap_chain_framebuffers[i]) != VK_SUCCESS) {
-      fprintf(stderr, "ERROR: Failed to create framebuffer\n");
-      exit(1);
-    }
+  for (uint32_t i = 0; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+    vkDestroyPipeline(logical_device, set->pipelines[i], NULL);
+    set->pipelines[i] = VK_NULL_HANDLE;
   }
 }
 
-void create_command_pool()
+// Creates the shader modules once and compiles every permutation from them. With a pool, the
+// workers take all permutations but the first, which the calling thread compiles meanwhile.
+// Reports its own errors and returns false instead of exiting.
+bool build_pipeline_set(AssetView vert_source, AssetView frag_source, ThreadPool *pool, PipelineSet *set)
 {
-  VkCommandPoolCreateInfo pool_info = {
-    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-    .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-    .queueFamilyIndex = queue_indices.graphics_index,
-  };
-  
-  if (vkCreateCommandPool(logical_device, &pool_info, NULL, &command_pool) != VK_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to create command pool\n");
-    exit(1);
+  if (!is_spirv(vert_source) || !is_spirv(frag_source)) {
+    fprintf(stderr, "ERROR: Shader is not a SPIR-V binary\n");
+    return false;
   }
-}
 
-void create_command_buffers()
-{
-  VkCommandBufferAllocateInfo alloc_info = {
-    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-    .commandPool = command_pool,
-    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-    .commandBufferCount = MAX_FRAMES_IN_FLIGHT,
+  // The views are page aligned, so the SPIR-V words can be read in place.
+  VkShaderModuleCreateInfo create_info = {
+    .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+    .codeSize = vert_source.size,
+    .pCode = (const uint32_t*) vert_source.data,
   };
-
-  if (vkAllocateCommandBuffers(logical_device, &alloc_info, &command_buffers[0]) != VK_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to allocate command buffers\n");
-    exit(1);
+  
+  VkShaderModule vert_module;
+  if (vkCreateShaderModule(logical_device, &create_info, NULL, &vert_module) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Could not create vertex shader module\n");
+    return false;
   }
-}
 
-void create_sync_prims()
-{
-  VkSemaphoreCreateInfo semaphore_info = {
-    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
-  };
+  create_info.codeSize = frag_source.size;
+  create_info.pCode = (const uint32_t*) frag_source.data;
 
-  VkFenceCreateInfo fence_info = {
-    .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-    .flags = VK_FENCE_CREATE_SIGNALED_BIT,
-  };
+  VkShaderModule frag_module;
+  if (vkCreateShaderModule(logical_device, &create_info, NULL, &frag_module) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Could not create fragment shader module\n");
+    vkDestroyShaderModule(logical_device, vert_module, NULL);
+    return false;
+  }
 
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-    if (vkCreateSemaphore(logical_device, &semaphore_info, NULL, &img_available_semaphores[i]) != VK_SUCCESS ||
-	vkCreateSemaphore(logical_device, &semaphore_info, NULL, &render_finished_semaphores[i]) != VK_SUCCESS ||
-	vkCreateFence(logical_device, &fence_info, NULL, &in_flight_fences[i]) != VK_SUCCESS) {
+  WaitGroup group;
+  wait_group_init(&group);
+  PipelineBuildJob jobs[PIPELINE_PERMUTATION_COUNT];
+  for (uint32_t i = 0; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+    jobs[i] = (PipelineBuildJob) {
+      .permutation = &pipeline_permutations[i],
+      .vert_module = vert_module,
+      .frag_module = frag_module,
+      .group = pool != NULL && i > 0 ? &group : NULL,
+    };
+  }
+  if (pool != NULL) {
+    wait_group_add(&group, PIPELINE_PERMUTATION_COUNT - 1);
+    for (uint32_t i = 1; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+      thread_pool_submit(pool, build_permutation_job, &jobs[i]);
+    }
+    build_permutation_job(&jobs[0]);
+  } else {
+    for (uint32_t i = 0; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+      build_permutation_job(&jobs[i]);
+    }
+  }
+  wait_group_wait(&group);
+  wait_group_destroy(&group);
+  vkDestroyShaderModule(logical_device, frag_module, NULL);
+  vkDestroyShaderModule(logical_device, vert_module, NULL);
+
+  bool ok = true;
+  for (uint32_t i = 0; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+    set->pipelines[i] = jobs[i].pipeline;
+    set->compile_ms[i] = jobs[i].compile_ms;
+    ok = ok && jobs[i].pipeline != VK_NULL_HANDLE;
+  }
+  if (!ok) {
+    destroy_pipeline_set(set);
+  }
+  return ok;
+}
+
+// Runs on the watcher thread, so a slow compile never holds up a frame. The permutations are
+// compiled one after another: the thread pool records every frame and must not queue behind them.
+static void reload_shaders(void *arg)
+{
+  (void) arg;
+  double start = time_now_ms();
+  PipelineSet *set = calloc(1, sizeof(PipelineSet));
+  if (set == NULL) {
+    fprintf(stderr, "WARNING: Could not allocate pipelines for the shader reload\n");
+    return;
+  }
+
+  AssetView vert_source = {0}, frag_source = {0};
+  bool built = asset_map(VERT_SHADER_PATH, &vert_source) && asset_map(FRAG_SHADER_PATH, &frag_source) &&
+    build_pipeline_set(vert_source, frag_source, NULL, set);
+  asset_release(&vert_source);
+  asset_release(&frag_source);
+  if (!built) {
+    fprintf(stderr, "WARNING: Shader reload failed, keeping the current pipelines\n");
+    free(set);
+    return;
+  }
+
+  // Pipelines the render loop has not picked up yet were never bound and can go right away.
+  PipelineSet *unused = atomic_exchange(&shader_reload.ready, set);
+  if (unused != NULL) {
+    destroy_pipeline_set(unused);
+    free(unused);
+  }
+  printf("Rebuilt %zu graphics pipelines in %.1f ms\n", PIPELINE_PERMUTATION_COUNT, time_now_ms() - start);
+}
+
+void start_shader_reload()
+{
+  atomic_init(&shader_reload.ready, NULL);
+  if (!file_watcher_start(&shader_reload.watcher, SHADER_DIR, ".spv", reload_shaders, NULL)) {
+    fprintf(stderr, "WARNING: Shader hot reload is disabled\n");
+  }
+}
+
+// Called between frames: no recording is in progress, and frames still in flight keep the old
+// pipelines alive through the deletion queue until their serials complete.
+void apply_shader_reload()
+{
+  PipelineSet *set = atomic_exchange(&shader_reload.ready, NULL);
+  if (set == NULL) {
+    return;
+  }
+  for (uint32_t i = 0; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+    defer_destroy_pipeline(pipeline_set.pipelines[i]);
+  }
+  pipeline_set = *set;
+  free(set);
+  graphics_pipeline = pipeline_set.pipelines[config.pipeline];
+  invalidate_command_cache();
+}
+
+void stop_shader_reload()
+{
+  file_watcher_stop(&shader_reload.watcher);
+  PipelineSet *unused = atomic_exchange(&shader_reload.ready, NULL);
+  if (unused != NULL) {
+    destroy_pipeline_set(unused);
+    free(unused);
+  }
+}
+
+void create_cull_pipeline()
+{
+  if (!asset_wait(&startup_assets.cull_shader)) {
+    fprintf(stderr, "ERROR: Could not load culling shader\n");
+    exit(1);
+  }
+
+  VkShaderModuleCreateInfo module_info = {
+    .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+    .codeSize = startup_assets.cull_shader.view.size,
+    .pCode = (const uint32_t*) startup_assets.cull_shader.view.data,
+  };
+
+  VkShaderModule cull_module;
+  if (vkCreateShaderModule(logical_device, &module_info, NULL, &cull_module) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Could not create culling shader module\n");
+    exit(1);
+  }
+  asset_release(&startup_assets.cull_shader.view);
+
+  // Objects, per-frame draws, counts and commands, in the order cull.comp declares them.
+  VkDescriptorSetLayoutBinding bindings[4];
+  for (uint32_t i = 0; i < 4; ++i) {
+    bindings[i] = (VkDescriptorSetLayoutBinding) {
+      .binding = i,
+      .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+      .descriptorCount = 1,
+      .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+  }
+
+  VkDescriptorSetLayoutCreateInfo layout_info = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+    .bindingCount = 4,
+    .pBindings = bindings,
+  };
+
+  if (vkCreateDescriptorSetLayout(logical_device, &layout_info, NULL, &cull_desc_set_layout) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to create culling descriptor set layout\n");
+    exit(1);
+  }
+
+  VkPipelineLayoutCreateInfo pipeline_layout_info = {
+    .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+    .setLayoutCount = 1,
+    .pSetLayouts = &cull_desc_set_layout,
+  };
+
+  if (vkCreatePipelineLayout(logical_device, &pipeline_layout_info, NULL, &cull_pipeline_layout) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Could not create culling pipeline layout\n");
+    exit(1);
+  }
+
+  VkComputePipelineCreateInfo pipeline_info = {
+    .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+    .stage = {
+      .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+      .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+      .module = cull_module,
+      .pName = "main",
+    },
+    .layout = cull_pipeline_layout,
+  };
+
+  if (vkCreateComputePipelines(logical_device, pipeline_cache, 1, &pipeline_info, NULL, &cull_pipeline) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Could not create culling pipeline\n");
+    exit(1);
+  }
+
+  vkDestroyShaderModule(logical_device, cull_module, NULL);
+}
+
+void create_framebuffers()
+{
+  for (size_t i = 0; i < swap_chain_img_count; ++i) {
+    VkImageView attachments[] = {
+      swap_chain_img_views[i]
+    };
+
+    VkFramebufferCreateInfo frame_buffer_info = {
+      .sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+      .renderPass = render_pass,
+      .attachmentCount = 1,
+      .pAttachments = attachments,
+      .width = swap_chain_extent.width,
+      .height = swap_chain_extent.height,
+      .layers = 1,
+    };
+
+    if (vkCreateFramebuffer(logical_device, &frame_buffer_info, NULL, &swap_chain_framebuffers[i]) != VK_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to create framebuffer\n");
+      exit(1);
+    }
+  }
+}
+
+void create_offscreen_targets()
+{
+  swap_chain_img_count = config.frames_in_flight;
+  for (size_t i = 0; i < swap_chain_img_count; ++i) {
+    VkImageCreateInfo img_info = {
+      .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+      .imageType = VK_IMAGE_TYPE_2D,
+      .format = swap_chain_img_format,
+      .extent = (VkExtent3D) {.width = swap_chain_extent.width, .height = swap_chain_extent.height, .depth = 1},
+      .mipLevels = 1,
+      .arrayLayers = 1,
+      .samples = VK_SAMPLE_COUNT_1_BIT,
+      .tiling = VK_IMAGE_TILING_OPTIMAL,
+      .usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+      .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+      .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+
+    if (vkCreateImage(logical_device, &img_info, NULL, &swap_chain_imgs[i]) != VK_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to create offscreen image %ld\n", i);
+      exit(1);
+    }
+
+    VkMemoryRequirements mem_reqs;
+    vkGetImageMemoryRequirements(logical_device, swap_chain_imgs[i], &mem_reqs);
+
+    mem_alloc(&allocator, &mem_reqs, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false, &offscreen_imgs_alloc[i]);
+    vkBindImageMemory(logical_device, swap_chain_imgs[i], offscreen_imgs_alloc[i].memory, offscreen_imgs_alloc[i].offset);
+  }
+
+  create_img_views();
+  create_framebuffers();
+}
+
+void create_command_pool()
+{
+  VkCommandPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    .queueFamilyIndex = queue_indices.graphics_index,
+  };
+  
+  if (vkCreateCommandPool(logical_device, &pool_info, NULL, &command_pool) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to create command pool\n");
+    exit(1);
+  }
+}
+
+// Splits the instances evenly over config.draw_count draws.
+void build_draw_list()
+{
+  draws = malloc(config.draw_count * sizeof(DrawCmd));
+  draw_mvps = config.push_constants ? malloc(config.draw_count * sizeof(mat4)) : NULL;
+  if (draws == NULL || (config.push_constants && draw_mvps == NULL)) {
+    fprintf(stderr, "ERROR: Could not allocate %u draws\n", config.draw_count);
+    exit(1);
+  }
+
+  for (uint32_t i = 0; i < config.draw_count; ++i) {
+    uint32_t first = (uint32_t) ((uint64_t) config.instance_count * i / config.draw_count);
+    uint32_t last = (uint32_t) ((uint64_t) config.instance_count * (i + 1) / config.draw_count);
+    draws[i] = (DrawCmd) {.first_instance = first, .instance_count = last - first};
+  }
+
+  transform_soa_init(&draw_transforms, config.draw_count);
+  transform_kernel = transform_best_kernel();
+}
+
+void create_record_slices()
+{
+  uint32_t slice_count = config.record_threads;
+  if (slice_count == 0) {
+    // One slice per worker plus the main thread, but only as many as keep every slice busy.
+    slice_count = thread_pool.thread_count + 1;
+    uint32_t useful = (config.draw_count + MIN_DRAWS_PER_RECORD_SLICE - 1) / MIN_DRAWS_PER_RECORD_SLICE;
+    if (useful < slice_count) {
+      slice_count = useful;
+    }
+  }
+  if (slice_count > config.draw_count) {
+    slice_count = config.draw_count;
+  }
+
+  // A single slice is recorded inline into the primary command buffer.
+  record_slice_count = slice_count > 1 ? slice_count : 0;
+  if (record_slice_count == 0) {
+    return;
+  }
+
+  record_slices = calloc(record_slice_count, sizeof(RecordSlice));
+  if (record_slices == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u record slices\n", record_slice_count);
+    exit(1);
+  }
+  wait_group_init(&record_done);
+
+  VkCommandPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+    .queueFamilyIndex = queue_indices.graphics_index,
+  };
+
+  for (uint32_t i = 0; i < record_slice_count; ++i) {
+    RecordSlice *slice = &record_slices[i];
+    slice->first_draw = (uint32_t) ((uint64_t) config.draw_count * i / record_slice_count);
+    slice->draw_count = (uint32_t) ((uint64_t) config.draw_count * (i + 1) / record_slice_count) - slice->first_draw;
+
+    for (size_t frame = 0; frame < config.frames_in_flight; ++frame) {
+      if (vkCreateCommandPool(logical_device, &pool_info, NULL, &slice->pools[frame]) != VK_SUCCESS) {
+	fprintf(stderr, "ERROR: Failed to create record command pool\n");
+	exit(1);
+      }
+
+      VkCommandBufferAllocateInfo alloc_info = {
+	.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+	.commandPool = slice->pools[frame],
+	.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+	.commandBufferCount = 1,
+      };
+
+      if (vkAllocateCommandBuffers(logical_device, &alloc_info, &slice->cmds[frame]) != VK_SUCCESS) {
+	fprintf(stderr, "ERROR: Failed to allocate secondary command buffer\n");
+	exit(1);
+      }
+    }
+  }
+}
+
+void destroy_record_slices()
+{
+  if (record_slice_count == 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < record_slice_count; ++i) {
+    for (size_t frame = 0; frame < config.frames_in_flight; ++frame) {
+      vkDestroyCommandPool(logical_device, record_slices[i].pools[frame], NULL);
+    }
+  }
+  wait_group_destroy(&record_done);
+  free(record_slices);
+}
+
+void create_command_buffers()
+{
+  VkCommandBufferAllocateInfo alloc_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .commandPool = command_pool,
+    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandBufferCount = config.frames_in_flight,
+  };
+
+  if (vkAllocateCommandBuffers(logical_device, &alloc_info, &command_buffers[0]) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to allocate command buffers\n");
+    exit(1);
+  }
+}
+
+void create_sync_prims()
+{
+  VkSemaphoreCreateInfo semaphore_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+  };
+
+  // Acquire and present only accept binary semaphores, everything else waits on the timelines.
+  for (size_t i = 0; i < config.frames_in_flight; ++i) {
+    if (vkCreateSemaphore(logical_device, &semaphore_info, NULL, &img_available_semaphores[i]) != VK_SUCCESS ||
+	vkCreateSemaphore(logical_device, &semaphore_info, NULL, &render_finished_semaphores[i]) != VK_SUCCESS) {
       fprintf(stderr, "ERROR: Failed to create synchronization primitives\n");
       exit(1);
 
     }
   }
+
+  create_timeline_semaphore(&timeline_semaphore);
+  create_timeline_semaphore(&transfer_timeline);
+}
+
+void create_timeline_semaphore(VkSemaphore *semaphore)
+{
+  VkSemaphoreTypeCreateInfo type_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+    .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+    .initialValue = 0,
+  };
+
+  VkSemaphoreCreateInfo semaphore_info = {
+    .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    .pNext = &type_info,
+  };
+
+  if (vkCreateSemaphore(logical_device, &semaphore_info, NULL, semaphore) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to create timeline semaphore\n");
+    exit(1);
+  }
+}
+
+void create_timestamp_query_pool()
+{
+  if (graphics_timestamp_valid_bits == 0) {
+    fprintf(stderr, "WARNING: Graphics queue does not support timestamps, GPU timings are disabled\n");
+    return;
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  timestamp_period_ns = properties.limits.timestampPeriod;
+
+  VkQueryPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+    .queryType = VK_QUERY_TYPE_TIMESTAMP,
+    .queryCount = config.frames_in_flight * TIMESTAMPS_PER_FRAME,
+  };
+
+  if (vkCreateQueryPool(logical_device, &pool_info, NULL, &timestamp_query_pool) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to create timestamp query pool\n");
+    exit(1);
+  }
+}
+
+// Called right after the slot's serial has completed, so the timestamps of the last frame
+// rendered in this slot are already available and the read never stalls.
+void read_gpu_timestamps(uint32_t frame)
+{
+  if (timestamp_query_pool == VK_NULL_HANDLE || !timestamps_pending[frame]) {
+    return;
+  }
+
+  uint64_t timestamps[TIMESTAMPS_PER_FRAME];
+  VkResult result = vkGetQueryPoolResults(logical_device, timestamp_query_pool, frame * TIMESTAMPS_PER_FRAME, TIMESTAMPS_PER_FRAME,
+					  sizeof(timestamps), timestamps, sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+  if (result != VK_SUCCESS) {
+    return;
+  }
+  timestamps_pending[frame] = false;
+
+  uint64_t mask = graphics_timestamp_valid_bits >= 64 ? UINT64_MAX : (1ULL << graphics_timestamp_valid_bits) - 1;
+  uint64_t ticks = ((timestamps[1] & mask) - (timestamps[0] & mask)) & mask;
+  sample_history_push(&frame_stats.gpu_render_pass, ticks * timestamp_period_ns / 1000000.0);
 }
 
 bool check_for_validation_layers()
@@ -761,13 +1889,145 @@ bool check_for_validation_layers()
       return false;
     }
   }
-  return true;
+  return true;
+}
+
+// Binds the frame's state and records draws[first_draw, first_draw + draw_count). Secondary command
+// buffers inherit nothing but the render pass, so this runs at the start of every slice.
+void record_draws(VkCommandBuffer command_buffer, uint32_t first_draw, uint32_t draw_count)
+{
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline);
+
+  VkViewport viewport = {
+    .x = 0.0f,
+    .y = 0.0f,
+    .width = (float) swap_chain_extent.width,
+    .height = (float) swap_chain_extent.height,
+    .minDepth = 0.0f,
+    .maxDepth = 1.0f,
+  };
+  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+  
+  VkRect2D scissor = {
+    .offset = (VkOffset2D) {.x = 0, .y = 0},
+    .extent = swap_chain_extent,
+  };
+  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+
+  VkBuffer vertex_buffers[] = {vertex_buffer, instance_buffers[current_frame]};
+  VkDeviceSize offsets[] = {0, 0};
+  vkCmdBindVertexBuffers(command_buffer, 0, 2, vertex_buffers, offsets);
+  vkCmdBindIndexBuffer(command_buffer, index_buffer, 0, mesh.header.index_size == sizeof(uint32_t) ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16);
+  if (config.push_constants || config.gpu_cull) {
+    // The shader still declares the UBO, so the set is bound once; the matrix is pushed per draw
+    // or read from the cull buffer.
+    uint32_t uniform_offset = uniform_ring_offset(current_frame, 0);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &desc_sets[current_frame], 1, &uniform_offset);
+  }
+  if (config.gpu_cull) {
+    // Nothing changes between culled draws, so their commands are consumed in one call.
+    vkCmdDrawIndexedIndirect(command_buffer, indirect_buffers[current_frame], first_draw * sizeof(VkDrawIndexedIndirectCommand),
+			     draw_count, sizeof(VkDrawIndexedIndirectCommand));
+    return;
+  }
+  for (uint32_t i = first_draw; i < first_draw + draw_count; ++i) {
+    if (config.push_constants) {
+      vkCmdPushConstants(command_buffer, pipeline_layout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(PushConstants), draw_mvps[i]);
+    } else {
+      uint32_t uniform_offset = uniform_ring_offset(current_frame, i);
+      vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &desc_sets[current_frame], 1, &uniform_offset);
+    }
+    vkCmdDrawIndexed(command_buffer, mesh.header.index_count, draws[i].instance_count, 0, 0, draws[i].first_instance);
+  }
+}
+
+// Resets the frame's commands, culls every instance and makes the commands and the visible list
+// available to the indirect draws. Runs outside the render pass; all inputs are read from memory,
+// so cached command buffers stay valid from frame to frame.
+void record_cull(VkCommandBuffer command_buffer)
+{
+  VkBuffer indirect_buffer = indirect_buffers[current_frame];
+  VkBufferCopy reset_region = {
+    .srcOffset = 0,
+    .dstOffset = 0,
+    .size = config.draw_count * sizeof(VkDrawIndexedIndirectCommand),
+  };
+  vkCmdCopyBuffer(command_buffer, indirect_template_buffer, indirect_buffer, 1, &reset_region);
+
+  VkBufferMemoryBarrier clear_barrier = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    .buffer = indirect_buffer,
+    .offset = 0,
+    .size = VK_WHOLE_SIZE,
+  };
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		       0, NULL, 1, &clear_barrier, 0, NULL);
+
+  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline);
+  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, cull_pipeline_layout, 0, 1, &cull_desc_sets[current_frame], 0, NULL);
+  vkCmdDispatch(command_buffer, (config.instance_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE, 1, 1);
+
+  VkBufferMemoryBarrier indirect_barrier = {
+    .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+    .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+    .dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT,
+    .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+    .buffer = indirect_buffer,
+    .offset = 0,
+    .size = VK_WHOLE_SIZE,
+  };
+  vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0,
+		       0, NULL, 1, &indirect_barrier, 0, NULL);
+}
+
+void record_slice(RecordSlice *slice)
+{
+  VkCommandBuffer command_buffer = slice->cmds[current_frame];
+  vkResetCommandPool(logical_device, slice->pools[current_frame], 0);
+
+  VkCommandBufferInheritanceInfo inheritance_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+    .renderPass = render_pass,
+    .subpass = 0,
+    // Cached secondaries are executed from the primaries of every swap chain image.
+    .framebuffer = config.cache_commands ? VK_NULL_HANDLE : swap_chain_framebuffers[slice->framebuffer_index],
+  };
+
+  // Recording a secondary into a second primary invalidates the first unless it allows
+  // simultaneous use.
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT |
+      (config.cache_commands ? VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT : VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT),
+    .pInheritanceInfo = &inheritance_info,
+  };
+
+  if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS) {
+    fprintf(stderr, "WARNING: Failed to begin recording secondary command buffer\n");
+    return;
+  }
+  record_draws(command_buffer, slice->first_draw, slice->draw_count);
+  if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+    fprintf(stderr, "WARNING: Failed to record secondary command buffer\n");
+  }
+}
+
+void record_slice_job(void *arg)
+{
+  record_slice(arg);
+  wait_group_done(&record_done);
 }
 
 void record_command_buffer(VkCommandBuffer command_buffer, uint32_t index)
 {
   VkCommandBufferBeginInfo beign_info = {
     .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = config.cache_commands ? VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT : 0,
   };
 
   if (vkBeginCommandBuffer(command_buffer, &beign_info) != VK_SUCCESS) {
@@ -775,6 +2035,21 @@ void record_command_buffer(VkCommandBuffer command_buffer, uint32_t index)
     return;
   }
 
+  uint32_t first_query = current_frame * TIMESTAMPS_PER_FRAME;
+  if (timestamp_query_pool != VK_NULL_HANDLE) {
+    vkCmdResetQueryPool(command_buffer, timestamp_query_pool, first_query, TIMESTAMPS_PER_FRAME);
+  }
+
+  if (config.gpu_cull) {
+    record_cull(command_buffer);
+  }
+
+  // The render pass time starts once the cull dispatch has finished, so it does not include it.
+  if (timestamp_query_pool != VK_NULL_HANDLE) {
+    vkCmdWriteTimestamp(command_buffer, config.gpu_cull ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+			timestamp_query_pool, first_query);
+  }
+
   VkClearValue clearColor = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
   VkRenderPassBeginInfo render_pass_info = {
     .sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
@@ -786,60 +2061,214 @@ void record_command_buffer(VkCommandBuffer command_buffer, uint32_t index)
     .pClearValues = &clearColor,
   };
 
-  vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-  vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, graphics_pipeline);
-
-  VkViewport viewport = {
-    .x = 0.0f,
-    .y = 0.0f,
-    .width = (float) swap_chain_extent.width,
-    .height = (float) swap_chain_extent.height,
-    .minDepth = 0.0f,
-    .maxDepth = 1.0f,
-  };
-  vkCmdSetViewport(command_buffer, 0, 1, &viewport);
-  
-  VkRect2D scissor = {
-    .offset = (VkOffset2D) {.x = 0, .y = 0},
-    .extent = swap_chain_extent,
-  };
-  vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+  if (record_slice_count == 0) {
+    vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
+    record_draws(command_buffer, 0, config.draw_count);
+  } else {
+    vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+    // Cached primaries of one frame slot share its secondaries, which are only re-recorded once
+    // per generation. Re-recording them for each image would invalidate the other primaries.
+    if (!config.cache_commands || record_slice_generations[current_frame] != command_cache_generation) {
+      // The main thread records the first slice itself instead of idling until the workers finish.
+      wait_group_add(&record_done, record_slice_count - 1);
+      for (uint32_t i = 0; i < record_slice_count; ++i) {
+	record_slices[i].framebuffer_index = index;
+	if (i > 0) {
+	  thread_pool_submit(&thread_pool, record_slice_job, &record_slices[i]);
+	}
+      }
+      record_slice(&record_slices[0]);
+      wait_group_wait(&record_done);
+      record_slice_generations[current_frame] = command_cache_generation;
+    }
 
-  VkBuffer vertex_buffers[] = {vertex_buffer};
-  VkDeviceSize offsets[] = {0};
-  vkCmdBindVertexBuffers(command_buffer, 0, 1, vertex_buffers, offsets);
-  vkCmdBindIndexBuffer(command_buffer, index_buffer, 0, VK_INDEX_TYPE_UINT16);
-  vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline_layout, 0, 1, &desc_sets[current_frame], 0, NULL);
-  vkCmdDrawIndexed(command_buffer, (uint32_t) (sizeof(indices)/sizeof(uint16_t)), 1, 0, 0, 0);
+    VkCommandBuffer secondary[record_slice_count];
+    for (uint32_t i = 0; i < record_slice_count; ++i) {
+      secondary[i] = record_slices[i].cmds[current_frame];
+    }
+    vkCmdExecuteCommands(command_buffer, record_slice_count, secondary);
+  }
   vkCmdEndRenderPass(command_buffer);
 
+  if (timestamp_query_pool != VK_NULL_HANDLE) {
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestamp_query_pool, first_query + 1);
+  }
+
   if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
     fprintf(stderr, "WARNING: Failed to record command buffer\n");
   }
 }
 
-#define DELTA_ROT .0001
+// Call whenever a handle or value baked into the recorded commands changes: the swap chain, a
+// pipeline, the draw list or the bound buffers.
+void invalidate_command_cache()
+{
+  ++command_cache_generation;
+}
+
+// Returns the command buffer to submit for this frame slot, recording it only when needed.
+// Must run after the slot's timeline wait.
+VkCommandBuffer frame_command_buffer(uint32_t img_index)
+{
+  double record_start = time_now_ms();
+  VkCommandBuffer command_buffer;
+
+  if (!config.cache_commands) {
+    command_buffer = command_buffers[current_frame];
+    vkResetCommandBuffer(command_buffer, 0);
+    record_command_buffer(command_buffer, img_index);
+  } else {
+    command_buffer = cached_command_buffers[current_frame][img_index];
+    if (command_buffer == VK_NULL_HANDLE) {
+      VkCommandBufferAllocateInfo alloc_info = {
+	.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+	.commandPool = command_pool,
+	.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+	.commandBufferCount = 1,
+      };
+
+      if (vkAllocateCommandBuffers(logical_device, &alloc_info, &command_buffer) != VK_SUCCESS) {
+	fprintf(stderr, "ERROR: Failed to allocate cached command buffer\n");
+	exit(1);
+      }
+      cached_command_buffers[current_frame][img_index] = command_buffer;
+    }
+
+    if (cached_command_generations[current_frame][img_index] != command_cache_generation) {
+      vkResetCommandBuffer(command_buffer, 0);
+      record_command_buffer(command_buffer, img_index);
+      cached_command_generations[current_frame][img_index] = command_cache_generation;
+    }
+  }
+
+  timestamps_pending[current_frame] = timestamp_query_pool != VK_NULL_HANDLE;
+  sample_history_push(&frame_stats.record, time_now_ms() - record_start);
+  return command_buffer;
+}
+
+void update_camera()
+{
+  if (!camera.dirty && camera.extent.width == swap_chain_extent.width && camera.extent.height == swap_chain_extent.height) {
+    return;
+  }
+
+  mat4 view;
+  mat4 proj;
+  glm_lookat(camera.eye, camera.center, camera.up, view);
+  glm_perspective(camera.fov, swap_chain_extent.width / (float) swap_chain_extent.height, camera.near_plane, camera.far_plane, proj);
+  proj[1][1] *= -1;
+  glm_mat4_mul(proj, view, camera.view_proj);
+  glm_frustum_planes(camera.view_proj, camera.frustum_planes);
+  camera.extent = swap_chain_extent;
+  camera.dirty = false;
+}
+
+// Hands the culling pass this frame's frustum and draw transforms.
+void update_cull_frame(uint32_t current_frame)
+{
+  CullFrame *frame = cull_frame_buffers_alloc[current_frame].mapped;
+  memcpy(frame->planes, camera.frustum_planes, sizeof(frame->planes));
+  for (uint32_t i = 0; i < config.draw_count; ++i) {
+    CullDraw *draw = &frame->draws[i];
+    transform_soa_get(&draw_transforms, i, draw->model);
+    draw->first_object = draws[i].first_instance;
+  }
+}
+
+// Writes every draw's MVP straight into the frame's slices of the mapped uniform ring, into
+// draw_mvps for the push constant path, or next to the cull inputs where culled draws read it.
 void update_uniform_buffer(uint32_t current_frame)
 {
-  static float angle = 0.0f;
-  angle = fmodf((angle + DELTA_ROT), 360.0f);
-  UniformBufferObject ubo = {0};
-  /* ubo.model = GLM_MAT4_IDENTITY_INIT; */
-  glm_mat4_identity(ubo.model);
-  glm_rotate(ubo.model, angle, (vec3) {0.0f, 0.0f, 1.0f});
-  glm_lookat((vec3) {2.0f, 2.0f, 2.0f}, (vec3) {0.0f, 0.0f, 0.0f}, (vec3) {0.0f, 0.0f, 1.0f}, ubo.view);
-  glm_perspective(45.0f, swap_chain_extent.width / (float) swap_chain_extent.height, 0.1f, 10.0f, ubo.proj);
-  ubo.proj[1][1] *= -1;
-  memcpy(uniform_buffers_mapped[current_frame], &ubo, sizeof(ubo));
+  double transform_start = time_now_ms();
+  update_camera();
+
+  SimState scene = sim_sample(&simulation, time_now_ms());
+  mat4 model;
+  glm_mat4_identity(model);
+  glm_rotate(model, (float) scene.angle, (vec3) {0.0f, 0.0f, 1.0f});
+
+  // For now every draw shares the same rotation.
+  for (uint32_t i = 0; i < config.draw_count; ++i) {
+    transform_soa_set(&draw_transforms, i, model);
+  }
+
+  if (config.gpu_cull) {
+    char *mvps = (char *) cull_frame_buffers_alloc[current_frame].mapped + cull_mvps_offset;
+    transform_batch_mvp(transform_kernel, camera.view_proj, &draw_transforms, mvps, sizeof(mat4));
+  } else if (config.push_constants) {
+    transform_batch_mvp(transform_kernel, camera.view_proj, &draw_transforms, draw_mvps, sizeof(mat4));
+  } else {
+    char *frame_base = (char *) uniform_ring.alloc.mapped + uniform_ring_offset(current_frame, 0);
+    transform_batch_mvp(transform_kernel, camera.view_proj, &draw_transforms, frame_base, uniform_ring.stride);
+  }
+  if (config.gpu_cull) {
+    update_cull_frame(current_frame);
+  }
+  sample_history_push(&frame_stats.transform, time_now_ms() - transform_start);
+}
+
+void draw_offscreen_frame()
+{
+  double wait_start = time_now_ms();
+  wait_for_serial(frame_serials[current_frame]);
+  sample_history_push(&frame_stats.frame_wait, time_now_ms() - wait_start);
+  read_gpu_timestamps(current_frame);
+  upload_poll();
+  observe_frame_completions();
+
+  update_uniform_buffer(current_frame);
+  update_instance_buffer(current_frame);
+
+  // Offscreen image i is only ever rendered by frame slot i, so the slot's serial also guards the image.
+  VkCommandBuffer command_buffer = frame_command_buffer(current_frame);
+
+  uint64_t signal_value = submitted_serial + 1;
+  VkTimelineSemaphoreSubmitInfo timeline_info = {
+    .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+    .signalSemaphoreValueCount = 1,
+    .pSignalSemaphoreValues = &signal_value,
+  };
+
+  VkSubmitInfo submit_info = {
+    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext = &timeline_info,
+    .commandBufferCount = 1,
+    .pCommandBuffers = &command_buffer,
+    .signalSemaphoreCount = 1,
+    .pSignalSemaphores = &timeline_semaphore,
+  };
+
+  if (vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+    fprintf(stderr, "WARNING: Failed to submit draw command buffer\n");
+  } else {
+    submitted_serial = signal_value;
+    frame_serials[current_frame] = signal_value;
+    pending_latencies[current_frame] = (PendingLatency) {.serial = signal_value, .start_ms = wait_start};
+    staging_ring_mark(signal_value);
+  }
 
+  current_frame = (current_frame + 1) % config.frames_in_flight;
 }
 
 void draw_frame()
 {
-  vkWaitForFences(logical_device, 1, &in_flight_fences[current_frame], VK_TRUE, UINT64_MAX);
+  if (config.headless) {
+    draw_offscreen_frame();
+    return;
+  }
+
+  double wait_start = time_now_ms();
+  wait_for_serial(frame_serials[current_frame]);
+  sample_history_push(&frame_stats.frame_wait, time_now_ms() - wait_start);
+  read_gpu_timestamps(current_frame);
+  upload_poll();
+  observe_frame_completions();
 
   uint32_t img_index;
+  double acquire_start = time_now_ms();
   VkResult result = vkAcquireNextImageKHR(logical_device, swap_chain, UINT64_MAX, img_available_semaphores[current_frame], VK_NULL_HANDLE, &img_index);
+  sample_history_push(&frame_stats.acquire, time_now_ms() - acquire_start);
 
   if (result == VK_ERROR_OUT_OF_DATE_KHR) {
     recreate_swap_chain();
@@ -850,29 +2279,45 @@ void draw_frame()
   }
 
   update_uniform_buffer(current_frame);
+  update_instance_buffer(current_frame);
 
-  vkResetFences(logical_device, 1, &in_flight_fences[current_frame]);
-  
-  vkResetCommandBuffer(command_buffers[current_frame], 0);
-  record_command_buffer(command_buffers[current_frame], img_index);
+  VkCommandBuffer command_buffer = frame_command_buffer(img_index);
 
+  // The binary semaphores ignore their values. Present only waits on the first signal semaphore.
+  uint64_t signal_value = submitted_serial + 1;
   VkSemaphore wait_semaphores[] = {img_available_semaphores[current_frame]};
-  VkSemaphore signal_semaphores[] = {render_finished_semaphores[current_frame]};
+  uint64_t wait_values[] = {0};
+  VkSemaphore signal_semaphores[] = {render_finished_semaphores[current_frame], timeline_semaphore};
+  uint64_t signal_values[] = {0, signal_value};
   VkPipelineStageFlags wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
 
+  VkTimelineSemaphoreSubmitInfo timeline_info = {
+    .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+    .waitSemaphoreValueCount = 1,
+    .pWaitSemaphoreValues = wait_values,
+    .signalSemaphoreValueCount = 2,
+    .pSignalSemaphoreValues = signal_values,
+  };
+
   VkSubmitInfo submit_info = {
     .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext = &timeline_info,
     .waitSemaphoreCount = 1,
     .pWaitSemaphores = wait_semaphores,
     .pWaitDstStageMask = wait_stages,
     .commandBufferCount = 1,
-    .pCommandBuffers = &command_buffers[current_frame],
-    .signalSemaphoreCount = 1,
+    .pCommandBuffers = &command_buffer,
+    .signalSemaphoreCount = 2,
     .pSignalSemaphores = signal_semaphores,
   };
 
-  if (vkQueueSubmit(graphics_queue, 1, &submit_info, in_flight_fences[current_frame]) != VK_SUCCESS) {
+  if (vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
     fprintf(stderr, "WARNING: Failed to submit draw command buffer\n");
+  } else {
+    submitted_serial = signal_value;
+    frame_serials[current_frame] = signal_value;
+    pending_latencies[current_frame] = (PendingLatency) {.serial = signal_value, .start_ms = wait_start};
+    staging_ring_mark(signal_value);
   }
 
   VkSwapchainKHR swap_chains[] = {swap_chain};
@@ -885,7 +2330,9 @@ void draw_frame()
     .pImageIndices = &img_index,
   };
   
+  double present_start = time_now_ms();
   result = vkQueuePresentKHR(presentation_queue, &present_info);
+  sample_history_push(&frame_stats.present, time_now_ms() - present_start);
   if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR || framebuffer_resized) {
     framebuffer_resized = false;
     recreate_swap_chain();
@@ -894,10 +2341,10 @@ void draw_frame()
     return;
   }
 
-  current_frame = (current_frame + 1) % MAX_FRAMES_IN_FLIGHT;
+  current_frame = (current_frame + 1) % config.frames_in_flight;
 }
 
-void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage_flags, VkMemoryPropertyFlags mem_flags, VkBuffer *buffer, VkDeviceMemory *buffer_mem)
+void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage_flags, VkMemoryPropertyFlags mem_flags, VkBuffer *buffer, MemAllocation *buffer_alloc)
 {
   VkBufferCreateInfo buffer_info = {
     .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
@@ -914,139 +2361,655 @@ void create_buffer(VkDeviceSize size, VkBufferUsageFlags usage_flags, VkMemoryPr
   VkMemoryRequirements mem_reqs;
   vkGetBufferMemoryRequirements(logical_device, *buffer, &mem_reqs);
 
-  VkPhysicalDeviceMemoryProperties mem_properties;
-  vkGetPhysicalDeviceMemoryProperties(physical_device, &mem_properties);
+  mem_alloc(&allocator, &mem_reqs, mem_flags, true, buffer_alloc);
+  vkBindBufferMemory(logical_device, *buffer, buffer_alloc->memory, buffer_alloc->offset);
+  
+}
+
+void create_staging_ring()
+{
+  staging_ring = (StagingRing) {.size = STAGING_RING_SIZE};
+  create_buffer(STAGING_RING_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_ring.buffer, &staging_ring.alloc);
+}
+
+bool staging_ring_alloc(VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset)
+{
+  VkDeviceSize start = (staging_ring.head + alignment - 1) / alignment * alignment;
+  // Allocations never straddle the end of the ring, skip to the start instead.
+  if (start % staging_ring.size + size > staging_ring.size) {
+    start = (start / staging_ring.size + 1) * staging_ring.size;
+  }
+  if (start + size - staging_ring.tail > staging_ring.size) {
+    return false;
+  }
+
+  staging_ring.head = start + size;
+  *offset = start % staging_ring.size;
+  return true;
+}
+
+// Everything allocated since the previous marker is released once serial retires.
+void staging_ring_mark(uint64_t serial)
+{
+  if (staging_ring.head == staging_ring.marked_head) {
+    return;
+  }
+  staging_ring.marked_head = staging_ring.head;
+
+  if (staging_ring.marker_count == STAGING_RING_MAX_MARKERS) {
+    // Folding into the newest marker only delays reclaiming its range until the later serial retires.
+    uint32_t last = (staging_ring.marker_first + staging_ring.marker_count - 1) % STAGING_RING_MAX_MARKERS;
+    staging_ring.markers[last] = (StagingMarker) {.head = staging_ring.head, .serial = serial};
+    return;
+  }
+
+  uint32_t index = (staging_ring.marker_first + staging_ring.marker_count) % STAGING_RING_MAX_MARKERS;
+  staging_ring.markers[index] = (StagingMarker) {.head = staging_ring.head, .serial = serial};
+  ++staging_ring.marker_count;
+}
+
+void retire_serial(uint64_t serial)
+{
+  if (serial > completed_serial) {
+    completed_serial = serial;
+  }
+
+  while (staging_ring.marker_count > 0 && staging_ring.markers[staging_ring.marker_first].serial <= completed_serial) {
+    staging_ring.tail = staging_ring.markers[staging_ring.marker_first].head;
+    staging_ring.marker_first = (staging_ring.marker_first + 1) % STAGING_RING_MAX_MARKERS;
+    --staging_ring.marker_count;
+  }
+  flush_deletions(false);
+}
+
+void defer_deletion(PendingDeletion deletion)
+{
+  if (deletion_queue.first > 0 && deletion_queue.first + deletion_queue.count == deletion_queue.capacity) {
+    memmove(deletion_queue.items, deletion_queue.items + deletion_queue.first, deletion_queue.count * sizeof(PendingDeletion));
+    deletion_queue.first = 0;
+  }
+  deletion_queue.items = array_reserve(deletion_queue.items, &deletion_queue.capacity, deletion_queue.first + deletion_queue.count + 1, sizeof(PendingDeletion));
+
+  deletion.serial = submitted_serial;
+  deletion_queue.items[deletion_queue.first + deletion_queue.count++] = deletion;
+}
+
+// The handles passed to these are invalid for the caller from this point on.
+void defer_destroy_buffer(VkBuffer buffer, MemAllocation *alloc)
+{
+  defer_deletion((PendingDeletion) {.kind = DELETION_BUFFER, .buffer = {.handle = buffer, .alloc = *alloc}});
+  *alloc = (MemAllocation) {0};
+}
+
+void defer_destroy_image(VkImage image, MemAllocation *alloc)
+{
+  defer_deletion((PendingDeletion) {.kind = DELETION_IMAGE, .image = {.handle = image, .alloc = *alloc}});
+  *alloc = (MemAllocation) {0};
+}
+
+void defer_free_memory(MemAllocation *alloc)
+{
+  defer_deletion((PendingDeletion) {.kind = DELETION_MEMORY, .memory = *alloc});
+  *alloc = (MemAllocation) {0};
+}
+
+void defer_destroy_image_view(VkImageView img_view)
+{
+  defer_deletion((PendingDeletion) {.kind = DELETION_IMAGE_VIEW, .img_view = img_view});
+}
+
+void defer_destroy_framebuffer(VkFramebuffer framebuffer)
+{
+  defer_deletion((PendingDeletion) {.kind = DELETION_FRAMEBUFFER, .framebuffer = framebuffer});
+}
 
-  bool found = false;
-  uint32_t mem_index;
-  uint32_t type_filter = mem_reqs.memoryTypeBits;
-  for (uint32_t i = 0; i < mem_properties.memoryTypeCount; i++) {
-    if ((type_filter & (1 << i)) && (mem_properties.memoryTypes[i].propertyFlags & mem_flags) == mem_flags) {
-      found = true;
-      mem_index = i;
+void defer_destroy_pipeline(VkPipeline pipeline)
+{
+  defer_deletion((PendingDeletion) {.kind = DELETION_PIPELINE, .pipeline = pipeline});
+}
+
+void defer_destroy_pipeline_layout(VkPipelineLayout layout)
+{
+  defer_deletion((PendingDeletion) {.kind = DELETION_PIPELINE_LAYOUT, .pipeline_layout = layout});
+}
+
+void defer_destroy_desc_pool(VkDescriptorPool pool)
+{
+  defer_deletion((PendingDeletion) {.kind = DELETION_DESCRIPTOR_POOL, .desc_pool = pool});
+}
+
+// Destroys every queued object whose serial has completed, or all of them when the device is idle.
+void flush_deletions(bool all)
+{
+  while (deletion_queue.count > 0) {
+    PendingDeletion *deletion = &deletion_queue.items[deletion_queue.first];
+    if (!all && deletion->serial > completed_serial) {
+      break;
+    }
+
+    switch (deletion->kind) {
+    case DELETION_SWAPCHAIN:
+      vkDestroySwapchainKHR(logical_device, deletion->swap_chain, NULL);
+      break;
+    case DELETION_IMAGE_VIEW:
+      vkDestroyImageView(logical_device, deletion->img_view, NULL);
+      break;
+    case DELETION_FRAMEBUFFER:
+      vkDestroyFramebuffer(logical_device, deletion->framebuffer, NULL);
+      break;
+    case DELETION_BUFFER:
+      vkDestroyBuffer(logical_device, deletion->buffer.handle, NULL);
+      mem_free(&allocator, &deletion->buffer.alloc);
       break;
+    case DELETION_IMAGE:
+      vkDestroyImage(logical_device, deletion->image.handle, NULL);
+      mem_free(&allocator, &deletion->image.alloc);
+      break;
+    case DELETION_MEMORY:
+      mem_free(&allocator, &deletion->memory);
+      break;
+    case DELETION_PIPELINE:
+      vkDestroyPipeline(logical_device, deletion->pipeline, NULL);
+      break;
+    case DELETION_PIPELINE_LAYOUT:
+      vkDestroyPipelineLayout(logical_device, deletion->pipeline_layout, NULL);
+      break;
+    case DELETION_DESCRIPTOR_POOL:
+      vkDestroyDescriptorPool(logical_device, deletion->desc_pool, NULL);
+      break;
+    }
+    ++deletion_queue.first;
+    --deletion_queue.count;
+  }
+
+  if (deletion_queue.count == 0) {
+    deletion_queue.first = 0;
+  }
+}
+
+// Called once per frame after upload_poll(), whose timeline query is the only one this needs. Every
+// frame is timestamped the first time its serial is seen completed, so the latency is accurate to
+// one frame period whatever the number of frames in flight.
+void observe_frame_completions()
+{
+  double now = time_now_ms();
+  for (uint32_t i = 0; i < config.frames_in_flight; ++i) {
+    if (pending_latencies[i].serial != 0 && pending_latencies[i].serial <= completed_serial) {
+      sample_history_push(&frame_stats.latency, now - pending_latencies[i].start_ms);
+      pending_latencies[i].serial = 0;
+    }
+  }
+}
+
+// Blocks until the timeline reaches serial, then retires everything up to it.
+void wait_for_serial(uint64_t serial)
+{
+  if (serial > completed_serial) {
+    if (serial > submitted_serial) {
+      fprintf(stderr, "ERROR: No submission signals serial %llu\n", (unsigned long long) serial);
+      exit(1);
+    }
+
+    VkSemaphoreWaitInfo wait_info = {
+      .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+      .semaphoreCount = 1,
+      .pSemaphores = &timeline_semaphore,
+      .pValues = &serial,
+    };
+
+    if (vkWaitSemaphores(logical_device, &wait_info, UINT64_MAX) != VK_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to wait for timeline semaphore\n");
+      exit(1);
+    }
+  }
+  retire_serial(serial);
+}
+
+// Retires whatever the GPU has already finished, without blocking.
+void poll_timeline()
+{
+  uint64_t value;
+  if (vkGetSemaphoreCounterValue(logical_device, timeline_semaphore, &value) == VK_SUCCESS) {
+    retire_serial(value);
+  }
+}
+
+// Returns the ring offset of size free bytes. When the ring is full, the staged work is submitted
+// and the oldest staged submission is waited on, so oversized loads degrade to streaming.
+VkDeviceSize staging_ring_reserve(VkDeviceSize size)
+{
+  VkDeviceSize offset;
+  while (!staging_ring_alloc(size, STAGING_RING_ALIGNMENT, &offset)) {
+    upload_flush();
+    if (staging_ring.marker_count == 0) {
+      fprintf(stderr, "ERROR: Staging ring cannot hold %llu bytes\n", (unsigned long long) size);
+      exit(1);
+    }
+    wait_for_serial(staging_ring.markers[staging_ring.marker_first].serial);
+  }
+  return offset;
+}
+
+void destroy_staging_ring()
+{
+  vkDestroyBuffer(logical_device, staging_ring.buffer, NULL);
+  mem_free(&allocator, &staging_ring.alloc);
+}
+
+void create_upload_context()
+{
+  VkCommandPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+    .flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+    .queueFamilyIndex = queue_indices.transfer_index,
+  };
+
+  if (vkCreateCommandPool(logical_device, &pool_info, NULL, &upload_command_pool) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to create upload command pool\n");
+    exit(1);
+  }
+
+  VkCommandBufferAllocateInfo alloc_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+    .commandBufferCount = 1,
+  };
+
+  for (size_t i = 0; i < UPLOAD_BATCH_COUNT; ++i) {
+    UploadBatch *batch = &upload_batches[i];
+    *batch = (UploadBatch) {0};
+
+    alloc_info.commandPool = upload_command_pool;
+    if (vkAllocateCommandBuffers(logical_device, &alloc_info, &batch->transfer_cmd) != VK_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to allocate upload command buffer\n");
+      exit(1);
+    }
+
+    // The queue family ownership acquire has to execute on the graphics queue.
+    alloc_info.commandPool = command_pool;
+    if (vkAllocateCommandBuffers(logical_device, &alloc_info, &batch->acquire_cmd) != VK_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to allocate upload acquire command buffer\n");
+      exit(1);
+    }
+  }
+}
+
+// The staging space is released by retire_serial, this only makes the batch recordable again.
+void retire_upload_batch(UploadBatch *batch)
+{
+  batch->barrier_count = 0;
+  batch->dst_stages = 0;
+  batch->pending = false;
+}
+
+void upload_poll()
+{
+  poll_timeline();
+  for (size_t i = 0; i < UPLOAD_BATCH_COUNT; ++i) {
+    UploadBatch *batch = &upload_batches[i];
+    if (batch->pending && batch->serial <= completed_serial) {
+      retire_upload_batch(batch);
+    }
+  }
+}
+
+UploadBatch *upload_begin()
+{
+  UploadBatch *batch = &upload_batches[current_upload_batch];
+  if (batch->recording) {
+    return batch;
+  }
+
+  // Only blocks when every batch is still in flight.
+  if (batch->pending) {
+    wait_for_serial(batch->serial);
+    retire_upload_batch(batch);
+  }
+
+  VkCommandBufferBeginInfo begin_info = {
+    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+  };
+
+  vkResetCommandBuffer(batch->transfer_cmd, 0);
+  if (vkBeginCommandBuffer(batch->transfer_cmd, &begin_info) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to begin upload command buffer\n");
+    exit(1);
+  }
+  batch->recording = true;
+  return batch;
+}
+
+// Copies data through the staging ring in chunks, so uploads of any size only ever need a quarter of the ring.
+void upload_buffer(VkBuffer dst_buffer, const void *data, VkDeviceSize size, VkPipelineStageFlags dst_stage, VkAccessFlags dst_access)
+{
+  const VkDeviceSize max_chunk = STAGING_RING_SIZE / 4;
+  for (VkDeviceSize done = 0; done < size;) {
+    VkDeviceSize chunk = size - done < max_chunk ? size - done : max_chunk;
+    VkDeviceSize staging_offset = staging_ring_reserve(chunk);
+    UploadBatch *batch = upload_begin();
+
+    memcpy((char *) staging_ring.alloc.mapped + staging_offset, (const char *) data + done, (size_t) chunk);
+
+    VkBufferCopy copy_region = {
+      .srcOffset = staging_offset,
+      .dstOffset = done,
+      .size = chunk,
+    };
+    vkCmdCopyBuffer(batch->transfer_cmd, staging_ring.buffer, dst_buffer, 1, &copy_region);
+
+    batch->barriers = array_reserve(batch->barriers, &batch->barrier_capacity, batch->barrier_count + 1, sizeof(VkBufferMemoryBarrier));
+    batch->barriers[batch->barrier_count++] = (VkBufferMemoryBarrier) {
+      .sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+      .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+      .dstAccessMask = dst_access,
+      .srcQueueFamilyIndex = queue_indices.transfer_index,
+      .dstQueueFamilyIndex = queue_indices.graphics_index,
+      .buffer = dst_buffer,
+      .offset = done,
+      .size = chunk,
+    };
+    batch->dst_stages |= dst_stage;
+    done += chunk;
+  }
+}
+
+// Submits everything recorded since the last flush as one batch. When the transfer queue is a separate
+// family, the batch releases the buffers there and a small graphics submission acquires them, ordered
+// by the transfer timeline. Later frames on the graphics queue are ordered after the acquire barrier.
+// Either way the batch's last submission runs on the graphics queue and signals the batch serial.
+void upload_flush()
+{
+  UploadBatch *batch = &upload_batches[current_upload_batch];
+  if (!batch->recording) {
+    return;
+  }
+
+  bool ownership_transfer = queue_indices.transfer_index != queue_indices.graphics_index;
+  if (!ownership_transfer) {
+    for (uint32_t i = 0; i < batch->barrier_count; ++i) {
+      batch->barriers[i].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+      batch->barriers[i].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    }
+    vkCmdPipelineBarrier(batch->transfer_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, batch->dst_stages, 0,
+			 0, NULL, batch->barrier_count, batch->barriers, 0, NULL);
+  } else {
+    // Release: the destination access is ignored on the releasing queue.
+    VkAccessFlags dst_access[batch->barrier_count];
+    for (uint32_t i = 0; i < batch->barrier_count; ++i) {
+      dst_access[i] = batch->barriers[i].dstAccessMask;
+      batch->barriers[i].dstAccessMask = 0;
+    }
+    vkCmdPipelineBarrier(batch->transfer_cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+			 0, NULL, batch->barrier_count, batch->barriers, 0, NULL);
+    for (uint32_t i = 0; i < batch->barrier_count; ++i) {
+      batch->barriers[i].srcAccessMask = 0;
+      batch->barriers[i].dstAccessMask = dst_access[i];
     }
   }
-  
-  if (!found) {
-    fprintf(stderr, "ERROR: Failed to find suitable memory type\n");
+
+  if (vkEndCommandBuffer(batch->transfer_cmd) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to record upload command buffer\n");
     exit(1);
   }
+  batch->recording = false;
+
+  uint64_t serial = submitted_serial + 1;
+  uint64_t transfer_value = transfer_timeline_value + 1;
+  VkTimelineSemaphoreSubmitInfo transfer_timeline_info = {
+    .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+    .signalSemaphoreValueCount = 1,
+    .pSignalSemaphoreValues = ownership_transfer ? &transfer_value : &serial,
+  };
 
-  VkMemoryAllocateInfo alloc_info = {
-    .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-    .allocationSize = mem_reqs.size,
-    .memoryTypeIndex = mem_index,
+  VkSubmitInfo transfer_submit = {
+    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+    .pNext = &transfer_timeline_info,
+    .commandBufferCount = 1,
+    .pCommandBuffers = &batch->transfer_cmd,
+    .signalSemaphoreCount = 1,
+    .pSignalSemaphores = ownership_transfer ? &transfer_timeline : &timeline_semaphore,
   };
 
-  if (vkAllocateMemory(logical_device, &alloc_info, NULL, buffer_mem) != VK_SUCCESS) {
-    fprintf(stderr, "ERROR: Failed to allocate vertex buffer memory\n");
+  if (vkQueueSubmit(transfer_queue, 1, &transfer_submit, VK_NULL_HANDLE) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to submit upload batch\n");
     exit(1);
   }
-  
-  vkBindBufferMemory(logical_device, *buffer, *buffer_mem, 0);
-  
-}
-void copy_buffer(VkBuffer src_buffer, VkBuffer dst_buffer, VkDeviceSize size)
-{
-  VkCommandBufferAllocateInfo alloc_info = {
-    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-    .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-    .commandPool = command_pool,
-    .commandBufferCount = 1,
-  };
 
-  VkCommandBuffer command_buffer;
-  vkAllocateCommandBuffers(logical_device, &alloc_info, &command_buffer);
+  if (ownership_transfer) {
+    VkCommandBufferBeginInfo begin_info = {
+      .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+      .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
 
-  VkCommandBufferBeginInfo begin_info = {
-    .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-    .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-  };
+    vkResetCommandBuffer(batch->acquire_cmd, 0);
+    vkBeginCommandBuffer(batch->acquire_cmd, &begin_info);
+    vkCmdPipelineBarrier(batch->acquire_cmd, batch->dst_stages, batch->dst_stages, 0,
+			 0, NULL, batch->barrier_count, batch->barriers, 0, NULL);
+    if (vkEndCommandBuffer(batch->acquire_cmd) != VK_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to record upload acquire command buffer\n");
+      exit(1);
+    }
 
-  vkBeginCommandBuffer(command_buffer, &begin_info);
+    VkTimelineSemaphoreSubmitInfo acquire_timeline_info = {
+      .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+      .waitSemaphoreValueCount = 1,
+      .pWaitSemaphoreValues = &transfer_value,
+      .signalSemaphoreValueCount = 1,
+      .pSignalSemaphoreValues = &serial,
+    };
 
-  VkBufferCopy copy_region = {
-    .size = size,
-  };
-  vkCmdCopyBuffer(command_buffer, src_buffer, dst_buffer, 1, &copy_region);
-  vkEndCommandBuffer(command_buffer);
+    VkSubmitInfo acquire_submit = {
+      .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+      .pNext = &acquire_timeline_info,
+      .waitSemaphoreCount = 1,
+      .pWaitSemaphores = &transfer_timeline,
+      .pWaitDstStageMask = &batch->dst_stages,
+      .commandBufferCount = 1,
+      .pCommandBuffers = &batch->acquire_cmd,
+      .signalSemaphoreCount = 1,
+      .pSignalSemaphores = &timeline_semaphore,
+    };
 
-  VkSubmitInfo submit_info = {
-    .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-    .commandBufferCount = 1,
-    .pCommandBuffers = &command_buffer,
-  };
-  
-  vkQueueSubmit(graphics_queue, 1, &submit_info, VK_NULL_HANDLE);
-  vkQueueWaitIdle(graphics_queue);
+    if (vkQueueSubmit(graphics_queue, 1, &acquire_submit, VK_NULL_HANDLE) != VK_SUCCESS) {
+      fprintf(stderr, "ERROR: Failed to submit upload acquire\n");
+      exit(1);
+    }
+    transfer_timeline_value = transfer_value;
+  }
 
-  vkFreeCommandBuffers(logical_device, command_pool, 1, &command_buffer);
+  submitted_serial = serial;
+  batch->serial = serial;
+  staging_ring_mark(batch->serial);
+  batch->pending = true;
+  current_upload_batch = (current_upload_batch + 1) % UPLOAD_BATCH_COUNT;
 }
 
-void create_vertex_buffer()
+void destroy_upload_context()
 {
-  VkDeviceSize buffer_size = sizeof(vertices);
+  for (size_t i = 0; i < UPLOAD_BATCH_COUNT; ++i) {
+    UploadBatch *batch = &upload_batches[i];
+    if (batch->pending) {
+      wait_for_serial(batch->serial);
+    }
+    retire_upload_batch(batch);
+    free(batch->barriers);
+  }
+  vkDestroyCommandPool(logical_device, upload_command_pool, NULL);
+}
+
+VkFormat mesh_attrib_vk_format(uint32_t format)
+{
+  switch (format) {
+  case MESH_ATTRIB_FLOAT2: return VK_FORMAT_R32G32_SFLOAT;
+  case MESH_ATTRIB_FLOAT3: return VK_FORMAT_R32G32B32_SFLOAT;
+  case MESH_ATTRIB_FLOAT4: return VK_FORMAT_R32G32B32A32_SFLOAT;
+  case MESH_ATTRIB_SNORM16X2: return VK_FORMAT_R16G16_SNORM;
+  case MESH_ATTRIB_SNORM16X4: return VK_FORMAT_R16G16B16A16_SNORM;
+  case MESH_ATTRIB_HALF2: return VK_FORMAT_R16G16_SFLOAT;
+  case MESH_ATTRIB_HALF4: return VK_FORMAT_R16G16B16A16_SFLOAT;
+  case MESH_ATTRIB_UNORM8X4: return VK_FORMAT_R8G8B8A8_UNORM;
+  // Fetched as two floats; unfolding is left to the shader.
+  case MESH_ATTRIB_OCT16: return VK_FORMAT_R16G16_SNORM;
+  default: return VK_FORMAT_UNDEFINED;
+  }
+}
 
-  VkBuffer staging_buffer;
-  VkDeviceMemory staging_buffer_mem;
-  create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_buffer_mem);
+// Maps the --mesh file, or wraps the built-in quad in the same layout description.
+void load_mesh()
+{
+  if (config.mesh_path == NULL) {
+    mesh = (Mesh) {
+      .header = {
+	.vertex_count = sizeof(quad_vertices) / sizeof(Vertex),
+	.vertex_stride = sizeof(Vertex),
+	.index_count = sizeof(quad_indices) / sizeof(uint16_t),
+	.index_size = sizeof(uint16_t),
+	.attrib_count = 2,
+	.attribs = {
+	  {.location = 0, .format = MESH_ATTRIB_FLOAT3, .offset = offsetof(Vertex, position)},
+	  {.location = 1, .format = MESH_ATTRIB_FLOAT3, .offset = offsetof(Vertex, color)},
+	},
+	.position_scale = 1.0f,
+      },
+      .vertices = quad_vertices,
+      .indices = quad_indices,
+    };
+    return;
+  }
 
-  void* data;
-  vkMapMemory(logical_device, staging_buffer_mem, 0, (size_t) buffer_size, 0, &data);
-  memcpy(data, vertices, (size_t) buffer_size);
-  vkUnmapMemory(logical_device, staging_buffer_mem);
+  if (!asset_wait(&startup_assets.mesh) || !mesh_from_view(config.mesh_path, startup_assets.mesh.view, &mesh)) {
+    exit(1);
+  }
+  startup_assets.mesh.view = (AssetView) {0};
 
-  create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertex_buffer, &vertex_buffer_mem);
+  // The vertex shader reads a position from location 0 and a color from location 1. Further
+  // attributes such as normals are uploaded but only fetched by shaders that declare them.
+  for (uint32_t location = 0; location < 2; ++location) {
+    if (mesh_find_attrib(&mesh.header, location) == NULL) {
+      fprintf(stderr, "ERROR: Mesh %s has no attribute for location %u\n", config.mesh_path, location);
+      exit(1);
+    }
+  }
+  for (uint32_t i = 0; i < mesh.header.attrib_count; ++i) {
+    uint32_t location = mesh.header.attribs[i].location;
+    if (location >= INSTANCE_ATTRIB_LOCATION && location < INSTANCE_ATTRIB_LOCATION + INSTANCE_ATTRIB_COUNT) {
+      fprintf(stderr, "ERROR: Mesh %s uses location %u, which is reserved for instance data\n", config.mesh_path, location);
+      exit(1);
+    }
+  }
+}
 
-  copy_buffer(staging_buffer, vertex_buffer, buffer_size);
+void create_vertex_buffer()
+{
+  VkDeviceSize buffer_size = (VkDeviceSize) mesh.header.vertex_count * mesh.header.vertex_stride;
 
-  vkDestroyBuffer(logical_device, staging_buffer, NULL);
-  vkFreeMemory(logical_device, staging_buffer_mem, NULL);
+  create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vertex_buffer, &vertex_buffer_alloc);
+  upload_buffer(vertex_buffer, mesh.vertices, buffer_size, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT);
 }
 
 void create_index_buffer()
 {
-  VkDeviceSize buffer_size = sizeof(indices);
+  VkDeviceSize buffer_size = (VkDeviceSize) mesh.header.index_count * mesh.header.index_size;
+
+  create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer, &index_buffer_alloc);
+  upload_buffer(index_buffer, mesh.indices, buffer_size, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_ACCESS_INDEX_READ_BIT);
+}
 
-  VkBuffer staging_buffer;
-  VkDeviceMemory staging_buffer_mem;
-  create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &staging_buffer, &staging_buffer_mem);
+// Lays the instances out on a square grid covering the area of a single quad, so one instance
+// looks exactly like the non-instanced draw. Each model matrix ends with the mesh's position
+// dequantization, so quantized positions cost nothing extra in the shader.
+void build_instance_grid()
+{
+  instances = malloc(config.instance_count * sizeof(InstanceData));
+  if (instances == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u instances\n", config.instance_count);
+    exit(1);
+  }
 
-  void* data;
-  vkMapMemory(logical_device, staging_buffer_mem, 0, buffer_size, 0, &data);
-  memcpy(data, indices, (size_t) buffer_size);
-  vkUnmapMemory(logical_device, staging_buffer_mem);
+  uint32_t side = (uint32_t) ceil(sqrt((double) config.instance_count));
+  float cell = 1.0f / side;
+  float scale = side > 1 ? cell * 0.9f : 1.0f;
+  mat4 dequantize;
+  glm_translate_make(dequantize, mesh.header.position_offset);
+  glm_scale_uni(dequantize, mesh.header.position_scale);
+  for (uint32_t i = 0; i < config.instance_count; ++i) {
+    uint32_t x = i % side;
+    uint32_t y = i / side;
+    InstanceData *instance = &instances[i];
+    glm_mat4_identity(instance->model);
+    glm_translate(instance->model, (vec3) {(x + 0.5f) * cell - 0.5f, (y + 0.5f) * cell - 0.5f, 0.0f});
+    glm_scale(instance->model, (vec3) {scale, scale, 1.0f});
+    glm_mat4_mul(instance->model, dequantize, instance->model);
+
+    if (config.instance_count == 1) {
+      glm_vec4_copy((vec4) {1.0f, 1.0f, 1.0f, 1.0f}, instance->color);
+    } else {
+      // Partly transparent, so the blended pipelines show the instances overlapping.
+      glm_vec4_copy((vec4) {0.5f + 0.5f * x / side, 0.5f + 0.5f * y / side, 1.0f - 0.5f * x / side, 0.75f}, instance->color);
+    }
+  }
+}
 
-  create_buffer(buffer_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &index_buffer, &index_buffer_mem);
+void create_instance_buffers()
+{
+  build_instance_grid();
 
-  copy_buffer(staging_buffer, index_buffer, buffer_size);
+  VkDeviceSize buffer_size = config.instance_count * sizeof(InstanceData);
+  for (size_t i = 0; i < config.frames_in_flight; ++i) {
+    create_buffer(buffer_size, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &instance_buffers[i], &instance_buffers_alloc[i]);
+    instance_buffers_dirty[i] = true;
+  }
+}
 
-  vkDestroyBuffer(logical_device, staging_buffer, NULL);
-  vkFreeMemory(logical_device, staging_buffer_mem, NULL);
+// Called after the frame's timeline wait, when the GPU is done with this frame's copy.
+void update_instance_buffer(uint32_t current_frame)
+{
+  if (!instance_buffers_dirty[current_frame]) {
+    return;
+  }
+  memcpy(instance_buffers_alloc[current_frame].mapped, instances, config.instance_count * sizeof(InstanceData));
+  instance_buffers_dirty[current_frame] = false;
 }
 
 void create_uniform_buffers()
 {
-  VkDeviceSize buffer_size = sizeof(UniformBufferObject);
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-    create_buffer(buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &uniform_buffers[i], &uniform_buffers_mem[i]);
-    vkMapMemory(logical_device, uniform_buffers_mem[i], 0, buffer_size, 0, &uniform_buffers_mapped[i]);
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  VkDeviceSize alignment = properties.limits.minUniformBufferOffsetAlignment;
+  if (alignment == 0) {
+    alignment = 1;
   }
+
+  uniform_ring.stride = (sizeof(UniformBufferObject) + alignment - 1) / alignment * alignment;
+  uniform_ring.frame_size = uniform_ring.stride * config.draw_count;
+  VkDeviceSize buffer_size = uniform_ring.frame_size * config.frames_in_flight;
+  // Dynamic offsets are 32 bit.
+  if (buffer_size > UINT32_MAX) {
+    fprintf(stderr, "ERROR: %u draws do not fit in one uniform buffer\n", config.draw_count);
+    exit(1);
+  }
+
+  create_buffer(buffer_size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &uniform_ring.buffer, &uniform_ring.alloc);
+}
+
+uint32_t uniform_ring_offset(uint32_t frame, uint32_t draw)
+{
+  return (uint32_t) (frame * uniform_ring.frame_size + draw * uniform_ring.stride);
 }
 
 void create_desc_pool()
 {
-  VkDescriptorPoolSize pool_size = {
-    .type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-    .descriptorCount = (uint32_t) MAX_FRAMES_IN_FLIGHT,
+  VkDescriptorPoolSize pool_sizes[2] = {
+    {.type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, .descriptorCount = config.frames_in_flight},
+    {.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 3 * config.frames_in_flight},
   };
 
   VkDescriptorPoolCreateInfo pool_info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-    .poolSizeCount = 1,
-    .pPoolSizes = &pool_size,
-    .maxSets = (uint32_t) MAX_FRAMES_IN_FLIGHT,
+    .poolSizeCount = 2,
+    .pPoolSizes = pool_sizes,
+    .maxSets = config.frames_in_flight,
   };
 
   if (vkCreateDescriptorPool(logical_device, &pool_info, NULL, &desc_pool) != VK_SUCCESS) {
@@ -1059,13 +3022,14 @@ void create_desc_pool()
 void create_desc_sets()
 {
   VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT];
-  for (uint32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+  for (size_t i = 0; i < config.frames_in_flight; ++i) {
     layouts[i] = desc_set_layout;
   }
+
   VkDescriptorSetAllocateInfo alloc_info = {
     .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
     .descriptorPool = desc_pool,
-    .descriptorSetCount = (uint32_t) MAX_FRAMES_IN_FLIGHT,
+    .descriptorSetCount = config.frames_in_flight,
     .pSetLayouts = layouts,
   };
 
@@ -1074,52 +3038,330 @@ void create_desc_sets()
     exit(1);
   }
 
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
-    VkDescriptorBufferInfo buffer_info = {
-      .buffer = uniform_buffers[i],
-      .offset = 0,
-      .range = sizeof(UniformBufferObject),
+  for (size_t i = 0; i < config.frames_in_flight; ++i) {
+    // The UBO range covers a single UniformBufferObject; the dynamic offset picks which one.
+    // Without --gpu-cull the storage bindings are never read, they only need a valid buffer.
+    VkDescriptorBufferInfo buffer_infos[4] = {
+      {.buffer = uniform_ring.buffer, .offset = 0, .range = sizeof(UniformBufferObject)},
+      {.buffer = instance_buffers[i], .offset = 0, .range = VK_WHOLE_SIZE},
+      {.buffer = instance_buffers[i], .offset = 0, .range = VK_WHOLE_SIZE},
+      {.buffer = instance_buffers[i], .offset = 0, .range = VK_WHOLE_SIZE},
     };
+    if (config.gpu_cull) {
+      buffer_infos[1] = (VkDescriptorBufferInfo) {.buffer = indirect_buffers[i], .offset = indirect_visible_offset, .range = VK_WHOLE_SIZE};
+      buffer_infos[3] = (VkDescriptorBufferInfo) {.buffer = cull_frame_buffers[i], .offset = cull_mvps_offset, .range = VK_WHOLE_SIZE};
+    }
 
-    VkWriteDescriptorSet descriptor_write = {
-      .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-      .dstSet = desc_sets[i],
-      .dstBinding = 0,
-      .dstArrayElement = 0,
-      .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
-      .descriptorCount = 1,
-      .pBufferInfo = &buffer_info,
+    VkWriteDescriptorSet descriptor_writes[4];
+    for (uint32_t j = 0; j < 4; ++j) {
+      descriptor_writes[j] = (VkWriteDescriptorSet) {
+	.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	.dstSet = desc_sets[i],
+	.dstBinding = j,
+	.dstArrayElement = 0,
+	.descriptorType = j == 0 ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+	.descriptorCount = 1,
+	.pBufferInfo = &buffer_infos[j],
+      };
+    }
+
+    vkUpdateDescriptorSets(logical_device, 4, descriptor_writes, 0, NULL);
+  }
+}
+
+
+// The per-instance bounding spheres and the per-draw command templates never change, so they are
+// built once and uploaded to device memory.
+void create_cull_buffers()
+{
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties(physical_device, &properties);
+  uint32_t group_count = (config.instance_count + CULL_GROUP_SIZE - 1) / CULL_GROUP_SIZE;
+  if (group_count > properties.limits.maxComputeWorkGroupCount[0]) {
+    fprintf(stderr, "ERROR: --gpu-cull supports at most %u instances on this GPU\n",
+	    properties.limits.maxComputeWorkGroupCount[0] * CULL_GROUP_SIZE);
+    exit(1);
+  }
+
+  VkDeviceSize objects_size = config.instance_count * sizeof(CullObject);
+  CullObject *objects = malloc(objects_size);
+  if (objects == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u cull objects\n", config.instance_count);
+    exit(1);
+  }
+
+  for (uint32_t d = 0; d < config.draw_count; ++d) {
+    for (uint32_t i = draws[d].first_instance; i < draws[d].first_instance + draws[d].instance_count; ++i) {
+      vec4 center = {mesh_bounds[0], mesh_bounds[1], mesh_bounds[2], 1.0f};
+      vec4 instance_center;
+      glm_mat4_mulv(instances[i].model, center, instance_center);
+      float scale = fmaxf(fmaxf(glm_vec3_norm(instances[i].model[0]), glm_vec3_norm(instances[i].model[1])), glm_vec3_norm(instances[i].model[2]));
+      objects[i] = (CullObject) {
+	.sphere = {instance_center[0], instance_center[1], instance_center[2], mesh_bounds[3] * scale},
+	.draw = d,
+      };
+    }
+  }
+
+  create_buffer(objects_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &cull_object_buffer, &cull_object_buffer_alloc);
+  upload_buffer(cull_object_buffer, objects, objects_size, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT);
+
+  // record_cull copies these over the frame's commands; the shader then counts the visible instances.
+  VkDeviceSize commands_size = config.draw_count * sizeof(VkDrawIndexedIndirectCommand);
+  VkDrawIndexedIndirectCommand *commands = malloc(commands_size);
+  if (commands == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u indirect commands\n", config.draw_count);
+    exit(1);
+  }
+  for (uint32_t d = 0; d < config.draw_count; ++d) {
+    commands[d] = (VkDrawIndexedIndirectCommand) {
+      .indexCount = mesh.header.index_count,
+      .instanceCount = 0,
+      .firstIndex = 0,
+      .vertexOffset = 0,
+      .firstInstance = draws[d].first_instance,
+    };
+  }
+
+  create_buffer(commands_size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &indirect_template_buffer, &indirect_template_buffer_alloc);
+  upload_buffer(indirect_template_buffer, commands, commands_size, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+  upload_flush();
+  free(objects);
+  free(commands);
+
+  VkDeviceSize alignment = properties.limits.minStorageBufferOffsetAlignment;
+  if (alignment == 0) {
+    alignment = 1;
+  }
+  indirect_visible_offset = (commands_size + alignment - 1) / alignment * alignment;
+  VkDeviceSize indirect_size = indirect_visible_offset + config.instance_count * 2 * sizeof(uint32_t);
+  VkDeviceSize cull_inputs_size = sizeof(CullFrame) + config.draw_count * sizeof(CullDraw);
+  cull_mvps_offset = (cull_inputs_size + alignment - 1) / alignment * alignment;
+  VkDeviceSize frame_size = cull_mvps_offset + config.draw_count * sizeof(mat4);
+  for (size_t i = 0; i < config.frames_in_flight; ++i) {
+    create_buffer(frame_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &cull_frame_buffers[i], &cull_frame_buffers_alloc[i]);
+    create_buffer(indirect_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &indirect_buffers[i], &indirect_buffers_alloc[i]);
+  }
+}
+
+void create_cull_desc_sets()
+{
+  VkDescriptorPoolSize pool_size = {
+    .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+    .descriptorCount = 4 * config.frames_in_flight,
+  };
+
+  VkDescriptorPoolCreateInfo pool_info = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+    .poolSizeCount = 1,
+    .pPoolSizes = &pool_size,
+    .maxSets = config.frames_in_flight,
+  };
+
+  if (vkCreateDescriptorPool(logical_device, &pool_info, NULL, &cull_desc_pool) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to create culling descriptor pool\n");
+    exit(1);
+  }
+
+  VkDescriptorSetLayout layouts[MAX_FRAMES_IN_FLIGHT];
+  for (size_t i = 0; i < config.frames_in_flight; ++i) {
+    layouts[i] = cull_desc_set_layout;
+  }
+
+  VkDescriptorSetAllocateInfo alloc_info = {
+    .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+    .descriptorPool = cull_desc_pool,
+    .descriptorSetCount = config.frames_in_flight,
+    .pSetLayouts = layouts,
+  };
+
+  if (vkAllocateDescriptorSets(logical_device, &alloc_info, cull_desc_sets) != VK_SUCCESS) {
+    fprintf(stderr, "ERROR: Failed to allocate culling descriptor sets\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < config.frames_in_flight; ++i) {
+    VkDescriptorBufferInfo buffer_infos[4] = {
+      {.buffer = cull_object_buffer, .offset = 0, .range = VK_WHOLE_SIZE},
+      {.buffer = cull_frame_buffers[i], .offset = 0, .range = VK_WHOLE_SIZE},
+      {.buffer = indirect_buffers[i], .offset = 0, .range = config.draw_count * sizeof(VkDrawIndexedIndirectCommand)},
+      {.buffer = indirect_buffers[i], .offset = indirect_visible_offset, .range = VK_WHOLE_SIZE},
     };
 
-    vkUpdateDescriptorSets(logical_device, 1, &descriptor_write, 0, NULL);
+    VkWriteDescriptorSet descriptor_writes[4];
+    for (uint32_t j = 0; j < 4; ++j) {
+      descriptor_writes[j] = (VkWriteDescriptorSet) {
+	.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+	.dstSet = cull_desc_sets[i],
+	.dstBinding = j,
+	.dstArrayElement = 0,
+	.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+	.descriptorCount = 1,
+	.pBufferInfo = &buffer_infos[j],
+      };
+    }
+
+    vkUpdateDescriptorSets(logical_device, 4, descriptor_writes, 0, NULL);
+  }
+}
+
+void init_frame_stats()
+{
+  size_t capacity = config.bench_frames > 0 ? config.bench_frames : FRAME_STATS_HISTORY;
+  sample_history_init(&frame_stats.cpu_frame, capacity);
+  sample_history_init(&frame_stats.frame_wait, capacity);
+  sample_history_init(&frame_stats.acquire, capacity);
+  sample_history_init(&frame_stats.present, capacity);
+  sample_history_init(&frame_stats.record, capacity);
+  sample_history_init(&frame_stats.transform, capacity);
+  sample_history_init(&frame_stats.latency, capacity);
+  sample_history_init(&frame_stats.gpu_render_pass, capacity);
+}
+
+void reset_frame_stats()
+{
+  sample_history_reset(&frame_stats.cpu_frame);
+  sample_history_reset(&frame_stats.frame_wait);
+  sample_history_reset(&frame_stats.acquire);
+  sample_history_reset(&frame_stats.present);
+  sample_history_reset(&frame_stats.record);
+  sample_history_reset(&frame_stats.transform);
+  sample_history_reset(&frame_stats.latency);
+  sample_history_reset(&frame_stats.gpu_render_pass);
+}
+
+void free_frame_stats()
+{
+  sample_history_free(&frame_stats.cpu_frame);
+  sample_history_free(&frame_stats.frame_wait);
+  sample_history_free(&frame_stats.acquire);
+  sample_history_free(&frame_stats.present);
+  sample_history_free(&frame_stats.record);
+  sample_history_free(&frame_stats.transform);
+  sample_history_free(&frame_stats.latency);
+  sample_history_free(&frame_stats.gpu_render_pass);
+}
+
+void print_bench_report(uint32_t frames, double elapsed_ms)
+{
+  printf("{\n");
+  printf("  \"frames\": %u,\n", frames);
+  printf("  \"headless\": %s,\n", config.headless ? "true" : "false");
+  printf("  \"instances\": %u,\n", config.instance_count);
+  printf("  \"draws\": %u,\n", config.draw_count);
+  printf("  \"record_slices\": %u,\n", record_slice_count ? record_slice_count : 1);
+  printf("  \"cached_commands\": %s,\n", config.cache_commands ? "true" : "false");
+  printf("  \"transform_path\": \"%s\",\n", config.push_constants ? "push_constants" : "uniform_buffer");
+  printf("  \"transform_kernel\": \"%s\",\n", transform_kernel_name(transform_kernel));
+  printf("  \"gpu_cull\": %s,\n", config.gpu_cull ? "true" : "false");
+  printf("  \"pipeline\": \"%s\",\n", pipeline_permutations[config.pipeline].name);
+  printf("  \"frames_in_flight\": %u,\n", config.frames_in_flight);
+  printf("  \"swapchain_images\": %u,\n", swap_chain_img_count);
+  printf("  \"present_mode\": \"%s\",\n", config.headless ? "none" : present_mode_name(present_mode));
+  printf("  \"elapsed_ms\": %.3f,\n", elapsed_ms);
+  printf("  \"avg_fps\": %.2f,\n", elapsed_ms > 0.0 ? frames * 1000.0 / elapsed_ms : 0.0);
+  printf("  \"startup\": {\"init_vulkan_ms\": %.3f, \"pipeline_create_ms\": %.3f, \"pipeline_cache\": \"%s\", \"mesh_load_ms\": %.3f, \"pipeline_compile_ms\": {",
+	 startup_timings.init_vulkan_ms, startup_timings.pipeline_create_ms,
+	 startup_timings.pipeline_cache_warm ? "warm" : "cold", startup_timings.mesh_load_ms);
+  for (uint32_t i = 0; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+    printf("%s\"%s\": %.3f", i > 0 ? ", " : "", pipeline_permutations[i].name, pipeline_set.compile_ms[i]);
   }
+  printf("}},\n");
+  printf("  ");
+  sample_summary_print_json(stdout, "cpu_frame_ms", sample_history_summarize(&frame_stats.cpu_frame));
+  printf(",\n  ");
+  sample_summary_print_json(stdout, "frame_wait_ms", sample_history_summarize(&frame_stats.frame_wait));
+  printf(",\n  ");
+  sample_summary_print_json(stdout, "acquire_ms", sample_history_summarize(&frame_stats.acquire));
+  printf(",\n  ");
+  sample_summary_print_json(stdout, "present_ms", sample_history_summarize(&frame_stats.present));
+  printf(",\n  ");
+  sample_summary_print_json(stdout, "record_ms", sample_history_summarize(&frame_stats.record));
+  printf(",\n  ");
+  sample_summary_print_json(stdout, "transform_ms", sample_history_summarize(&frame_stats.transform));
+  printf(",\n  ");
+  sample_summary_print_json(stdout, "frame_latency_ms", sample_history_summarize(&frame_stats.latency));
+  printf(",\n  ");
+  sample_summary_print_json(stdout, "gpu_render_pass_ms", sample_history_summarize(&frame_stats.gpu_render_pass));
+  printf(",\n  ");
+  mem_stats_print_json(stdout, "device_memory", mem_get_stats(&allocator));
+  printf("\n}\n");
 }
 
+bool should_quit()
+{
+  if (quit_requested) {
+    return true;
+  }
+  return !config.headless && glfwWindowShouldClose(window);
+}
 
 void main_loop()
 {
-  while (!glfwWindowShouldClose(window)) {
-    glfwPollEvents();
+  uint32_t frame_count = 0;
+  uint32_t bench_frames = 0;
+  double bench_start = 0.0;
+
+  while (!should_quit()) {
+    if (config.bench_frames > 0) {
+      if (frame_count == BENCH_WARMUP_FRAMES) {
+	reset_frame_stats();
+	bench_start = time_now_ms();
+      }
+      if (bench_frames == config.bench_frames) {
+	break;
+      }
+    }
+
+    double frame_start = time_now_ms();
+    if (!config.headless) {
+      glfwPollEvents();
+    }
+    if (config.hot_reload) {
+      apply_shader_reload();
+    }
     draw_frame();
+    sample_history_push(&frame_stats.cpu_frame, time_now_ms() - frame_start);
+
+    ++frame_count;
+    if (config.bench_frames > 0 && frame_count > BENCH_WARMUP_FRAMES) {
+      ++bench_frames;
+    }
   }
 
   vkDeviceWaitIdle(logical_device);
+
+  if (config.bench_frames > 0) {
+    print_bench_report(bench_frames, bench_frames > 0 ? time_now_ms() - bench_start : 0.0);
+  }
 }
 
+// Replaces the swap chain without waiting for the device. Frames already submitted keep rendering
+// into and presenting the old images; the old objects go through the deletion queue.
 void recreate_swap_chain()
 {
   int width = 0, height = 0;
   glfwGetFramebufferSize(window, &width, &height);
-  while (width == 0 || height == 0) {
-    glfwGetFramebufferSize(window, &width, &height);
+  if (width == 0 || height == 0) {
+    // Minimized. Sleep until something happens to the window and retry on the next frame.
+    framebuffer_resized = true;
     glfwWaitEvents();
+    return;
   }
-  
-  vkDeviceWaitIdle(logical_device);
-  cleanup_swap_chain();
-  create_swap_chain();
+
+  for (size_t i = 0; i < swap_chain_img_count; ++i) {
+    defer_destroy_framebuffer(swap_chain_framebuffers[i]);
+    defer_destroy_image_view(swap_chain_img_views[i]);
+  }
+
+  // The old swap chain is retired by the create call and can no longer acquire images.
+  VkSwapchainKHR old_swap_chain = swap_chain;
+  create_swap_chain(old_swap_chain);
+  defer_deletion((PendingDeletion) {.kind = DELETION_SWAPCHAIN, .swap_chain = old_swap_chain});
+
   create_img_views();
   create_framebuffers();
+  invalidate_command_cache();
 }
 
 void cleanup_swap_chain()
@@ -1130,36 +3372,81 @@ void cleanup_swap_chain()
   for (size_t i = 0; i < swap_chain_img_count; ++i) {
     vkDestroyImageView(logical_device, swap_chain_img_views[i], NULL);
   }
-  vkDestroySwapchainKHR(logical_device, swap_chain, NULL);
+  if (config.headless) {
+    for (size_t i = 0; i < swap_chain_img_count; ++i) {
+      vkDestroyImage(logical_device, swap_chain_imgs[i], NULL);
+      mem_free(&allocator, &offscreen_imgs_alloc[i]);
+    }
+  } else {
+    vkDestroySwapchainKHR(logical_device, swap_chain, NULL);
+  }
 }
 
 void cleanup()
 {
+  flush_deletions(true);
+  free(deletion_queue.items);
   cleanup_swap_chain();
   vkDestroyDescriptorSetLayout(logical_device, desc_set_layout, NULL);
   vkDestroyBuffer(logical_device, index_buffer, NULL);
-  vkFreeMemory(logical_device, index_buffer_mem, NULL);
+  mem_free(&allocator, &index_buffer_alloc);
   vkDestroyBuffer(logical_device, vertex_buffer, NULL);
-  vkFreeMemory(logical_device, vertex_buffer_mem, NULL);
+  mem_free(&allocator, &vertex_buffer_alloc);
   vkDestroyDescriptorPool(logical_device, desc_pool, NULL);
   vkDestroyDescriptorSetLayout(logical_device, desc_set_layout, NULL);
-  vkDestroyPipeline(logical_device, graphics_pipeline, NULL);
+  destroy_pipeline_set(&pipeline_set);
+  save_pipeline_cache();
+  vkDestroyPipelineCache(logical_device, pipeline_cache, NULL);
   vkDestroyPipelineLayout(logical_device, pipeline_layout, NULL);
   vkDestroyRenderPass(logical_device, render_pass, NULL);
-  for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i) {
+  for (size_t i = 0; i < config.frames_in_flight; ++i) {
     vkDestroySemaphore(logical_device, img_available_semaphores[i], NULL);
     vkDestroySemaphore(logical_device, render_finished_semaphores[i], NULL);
-    vkDestroyFence(logical_device, in_flight_fences[i], NULL);
-    vkDestroyBuffer(logical_device, uniform_buffers[i], NULL);
-    vkFreeMemory(logical_device, uniform_buffers_mem[i], NULL);
+    vkDestroyBuffer(logical_device, instance_buffers[i], NULL);
+    mem_free(&allocator, &instance_buffers_alloc[i]);
+  }
+  free(instances);
+  if (config.gpu_cull) {
+    for (size_t i = 0; i < config.frames_in_flight; ++i) {
+      vkDestroyBuffer(logical_device, cull_frame_buffers[i], NULL);
+      mem_free(&allocator, &cull_frame_buffers_alloc[i]);
+      vkDestroyBuffer(logical_device, indirect_buffers[i], NULL);
+      mem_free(&allocator, &indirect_buffers_alloc[i]);
+    }
+    vkDestroyBuffer(logical_device, cull_object_buffer, NULL);
+    mem_free(&allocator, &cull_object_buffer_alloc);
+    vkDestroyBuffer(logical_device, indirect_template_buffer, NULL);
+    mem_free(&allocator, &indirect_template_buffer_alloc);
+    vkDestroyDescriptorPool(logical_device, cull_desc_pool, NULL);
+    vkDestroyPipeline(logical_device, cull_pipeline, NULL);
+    vkDestroyPipelineLayout(logical_device, cull_pipeline_layout, NULL);
+    vkDestroyDescriptorSetLayout(logical_device, cull_desc_set_layout, NULL);
   }
+  vkDestroyBuffer(logical_device, uniform_ring.buffer, NULL);
+  mem_free(&allocator, &uniform_ring.alloc);
+  destroy_record_slices();
+  free(draws);
+  free(draw_mvps);
+  transform_soa_free(&draw_transforms);
   vkDestroyDescriptorSetLayout(logical_device, desc_set_layout, NULL);
+  destroy_upload_context();
+  destroy_staging_ring();
+  vkDestroySemaphore(logical_device, timeline_semaphore, NULL);
+  vkDestroySemaphore(logical_device, transfer_timeline, NULL);
   vkDestroyCommandPool(logical_device, command_pool, NULL);
+  if (timestamp_query_pool != VK_NULL_HANDLE) {
+    vkDestroyQueryPool(logical_device, timestamp_query_pool, NULL);
+  }
+  mem_allocator_destroy(&allocator);
   vkDestroyDevice(logical_device, NULL);
-  vkDestroySurfaceKHR(instance, surface, NULL);
+  if (!config.headless) {
+    vkDestroySurfaceKHR(instance, surface, NULL);
+  }
   vkDestroyInstance(instance, NULL);
-  glfwDestroyWindow(window);
-  glfwTerminate();
+  if (!config.headless) {
+    glfwDestroyWindow(window);
+    glfwTerminate();
+  }
 }
 
 void handle_framebuffer_resize(GLFWwindow*, int, int)
@@ -1167,11 +3454,249 @@ void handle_framebuffer_resize(GLFWwindow*, int, int)
   framebuffer_resized = true;
 }
 
-int main()
+void handle_quit_signal(int signal_number)
+{
+  (void) signal_number;
+  quit_requested = 1;
+}
+
+void print_usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [options]\n", program);
+  fprintf(stderr, "  --headless          Render into offscreen images without a window or swap chain\n");
+  fprintf(stderr, "  --bench <frames>    Render a fixed number of frames and print a JSON timing report\n");
+  fprintf(stderr, "  --mesh <file>       Draw a mesh converted with obj2mesh instead of the built-in quad\n");
+  fprintf(stderr, "  --instances <n>     Draw n copies of the mesh on a grid with one instanced draw call\n");
+  fprintf(stderr, "  --draws <n>         Split the instances over n draw calls\n");
+  fprintf(stderr, "  --record-threads <n> Record the draws on n threads, 1 records inline (default: automatic)\n");
+  fprintf(stderr, "  --cache-commands    Record command buffers once and replay them until invalidated\n");
+  fprintf(stderr, "  --push-constants    Pass each draw's final matrix as a push constant instead of a UBO slice\n");
+  fprintf(stderr, "  --gpu-cull          Frustum-cull instances in a compute pass and draw the survivors indirectly\n");
+  fprintf(stderr, "  --hot-reload        Rebuild the graphics pipelines in the background when %s/*.spv change\n", SHADER_DIR);
+  fprintf(stderr, "  --pipeline <name>   opaque, opaque-two-sided, blended or blended-two-sided (default: opaque)\n");
+  fprintf(stderr, "  --frames-in-flight <n> Frames the CPU may run ahead of the GPU, 1 to %u (default: 2)\n", MAX_FRAMES_IN_FLIGHT);
+  fprintf(stderr, "  --swapchain-images <n> Swap chain images to request (default: minimum + 1)\n");
+  fprintf(stderr, "  --present-mode <mode> immediate, mailbox, fifo or fifo_relaxed (default: mailbox if available)\n");
+  fprintf(stderr, "  --config <file>     Read options from file, one per line without the leading dashes\n");
+  fprintf(stderr, "  --help              Show this message\n");
+}
+
+uint32_t parse_u32_arg(const char *option, const char *value, uint32_t min)
+{
+  char *end;
+  unsigned long parsed = strtoul(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || parsed < min || parsed > UINT32_MAX) {
+    fprintf(stderr, "ERROR: Invalid value '%s' for %s\n", value, option);
+    exit(1);
+  }
+  return (uint32_t) parsed;
+}
+
+typedef struct {
+  const char *name;
+  VkPresentModeKHR mode;
+}PresentModeName;
+
+static const PresentModeName present_mode_names[] = {
+  {"immediate", VK_PRESENT_MODE_IMMEDIATE_KHR},
+  {"mailbox", VK_PRESENT_MODE_MAILBOX_KHR},
+  {"fifo", VK_PRESENT_MODE_FIFO_KHR},
+  {"fifo_relaxed", VK_PRESENT_MODE_FIFO_RELAXED_KHR},
+};
+
+const char *present_mode_name(VkPresentModeKHR mode)
+{
+  for (size_t i = 0; i < sizeof(present_mode_names) / sizeof(present_mode_names[0]); ++i) {
+    if (present_mode_names[i].mode == mode) {
+      return present_mode_names[i].name;
+    }
+  }
+  return "unknown";
+}
+
+VkPresentModeKHR parse_present_mode_arg(const char *option, const char *value)
+{
+  for (size_t i = 0; i < sizeof(present_mode_names) / sizeof(present_mode_names[0]); ++i) {
+    if (strcmp(present_mode_names[i].name, value) == 0) {
+      return present_mode_names[i].mode;
+    }
+  }
+  fprintf(stderr, "ERROR: Invalid value '%s' for %s\n", value, option);
+  exit(1);
+}
+
+uint32_t parse_pipeline_arg(const char *option, const char *value)
+{
+  for (uint32_t i = 0; i < PIPELINE_PERMUTATION_COUNT; ++i) {
+    if (strcmp(pipeline_permutations[i].name, value) == 0) {
+      return i;
+    }
+  }
+  fprintf(stderr, "ERROR: Invalid value '%s' for %s\n", value, option);
+  exit(1);
+}
+
+static void load_config_file(const char *file_path);
+
+// Applies a single option. value is the next argument, or NULL if there is none.
+// Returns the number of values consumed.
+int apply_option(const char *program, const char *option, const char *value)
+{
+  if (strcmp(option, "--headless") == 0) {
+    config.headless = true;
+  } else if (strcmp(option, "--cache-commands") == 0) {
+    config.cache_commands = true;
+  } else if (strcmp(option, "--push-constants") == 0) {
+    config.push_constants = true;
+  } else if (strcmp(option, "--gpu-cull") == 0) {
+    config.gpu_cull = true;
+  } else if (strcmp(option, "--hot-reload") == 0) {
+    config.hot_reload = true;
+  } else if (strcmp(option, "--help") == 0) {
+    print_usage(program);
+    exit(0);
+  } else if (value == NULL) {
+    fprintf(stderr, "ERROR: Unknown option %s or missing value\n", option);
+    print_usage(program);
+    exit(1);
+  } else if (strcmp(option, "--bench") == 0) {
+    config.bench_frames = parse_u32_arg(option, value, 1);
+    return 1;
+  } else if (strcmp(option, "--mesh") == 0) {
+    free(config.owned_mesh_path);
+    config.owned_mesh_path = NULL;
+    config.mesh_path = value;
+    return 1;
+  } else if (strcmp(option, "--instances") == 0) {
+    config.instance_count = parse_u32_arg(option, value, 1);
+    return 1;
+  } else if (strcmp(option, "--draws") == 0) {
+    config.draw_count = parse_u32_arg(option, value, 1);
+    return 1;
+  } else if (strcmp(option, "--record-threads") == 0) {
+    config.record_threads = parse_u32_arg(option, value, 1);
+    return 1;
+  } else if (strcmp(option, "--frames-in-flight") == 0) {
+    config.frames_in_flight = parse_u32_arg(option, value, 1);
+    if (config.frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+      fprintf(stderr, "ERROR: %s is limited to %u\n", option, MAX_FRAMES_IN_FLIGHT);
+      exit(1);
+    }
+    return 1;
+  } else if (strcmp(option, "--swapchain-images") == 0) {
+    config.swapchain_images = parse_u32_arg(option, value, 1);
+    return 1;
+  } else if (strcmp(option, "--pipeline") == 0) {
+    config.pipeline = parse_pipeline_arg(option, value);
+    return 1;
+  } else if (strcmp(option, "--present-mode") == 0) {
+    config.present_mode = parse_present_mode_arg(option, value);
+    config.present_mode_set = true;
+    return 1;
+  } else if (strcmp(option, "--config") == 0) {
+    load_config_file(value);
+    return 1;
+  } else {
+    fprintf(stderr, "ERROR: Unknown option %s\n", option);
+    print_usage(program);
+    exit(1);
+  }
+  return 0;
+}
+
+// Each line is an option name without the leading dashes, optionally followed by its value:
+//   frames-in-flight 3
+//   present-mode fifo
+// Blank lines and lines starting with # are skipped. Options are applied in order, so later
+// command line options override the file.
+void load_config_file(const char *file_path)
+{
+  static int depth = 0;
+  if (depth > 0) {
+    fprintf(stderr, "ERROR: %s: config files cannot include other config files\n", file_path);
+    exit(1);
+  }
+
+  FILE *file = fopen(file_path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "ERROR: Could not open file %s\n", file_path);
+    exit(1);
+  }
+
+  ++depth;
+  char line[1024];
+  uint32_t line_number = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    ++line_number;
+    char *key = strtok(line, " \t\r\n");
+    if (key == NULL || key[0] == '#') {
+      continue;
+    }
+    char *value = strtok(NULL, " \t\r\n");
+    if (strtok(NULL, " \t\r\n") != NULL) {
+      fprintf(stderr, "ERROR: %s:%u: Too many values for %s\n", file_path, line_number, key);
+      exit(1);
+    }
+
+    char option[128];
+    snprintf(option, sizeof(option), "--%s", key);
+    // --mesh keeps pointing at its value, so the copy is only freed if nothing kept it.
+    char *owned_value = value != NULL ? strdup(value) : NULL;
+    if (apply_option(file_path, option, owned_value) == 0 && owned_value != NULL) {
+      fprintf(stderr, "ERROR: %s:%u: %s takes no value\n", file_path, line_number, key);
+      exit(1);
+    }
+    if (owned_value != NULL && owned_value == config.mesh_path) {
+      config.owned_mesh_path = owned_value;
+    } else {
+      free(owned_value);
+    }
+  }
+  --depth;
+  fclose(file);
+}
+
+void parse_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc; ++i) {
+    i += apply_option(argv[0], argv[i], i + 1 < argc ? argv[i + 1] : NULL);
+  }
+
+  // Pushed matrices are baked into the command stream, so it has to be recorded every frame.
+  if (config.push_constants && config.cache_commands) {
+    fprintf(stderr, "WARNING: --cache-commands is ignored with --push-constants\n");
+    config.cache_commands = false;
+  }
+
+  if (config.draw_count > config.instance_count) {
+    fprintf(stderr, "ERROR: --draws %u needs at least as many instances\n", config.draw_count);
+    exit(1);
+  }
+}
+
+int main(int argc, char **argv)
 {
-  init_window();
+  parse_args(argc, argv);
+  signal(SIGINT, handle_quit_signal);
+  signal(SIGTERM, handle_quit_signal);
+  if (!config.headless) {
+    init_window();
+  }
+  init_frame_stats();
+  thread_pool_init(&thread_pool, 0);
   init_vulkan();
+  sim_start(&simulation, SIM_STEP_MS);
+  if (config.hot_reload) {
+    start_shader_reload();
+  }
   main_loop();
+  if (config.hot_reload) {
+    stop_shader_reload();
+  }
+  sim_stop(&simulation);
   cleanup();
+  thread_pool_destroy(&thread_pool);
+  free_frame_stats();
+  free(config.owned_mesh_path);
   return 0;
 }
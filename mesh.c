@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "mesh.h"
+
+static uint64_t align_section(uint64_t offset)
+{
+  return (offset + MESH_SECTION_ALIGNMENT - 1) / MESH_SECTION_ALIGNMENT * MESH_SECTION_ALIGNMENT;
+}
+
+uint32_t mesh_attrib_format_size(uint32_t format)
+{
+  switch (format) {
+  case MESH_ATTRIB_FLOAT2: return sizeof(float) * 2;
+  case MESH_ATTRIB_FLOAT3: return sizeof(float) * 3;
+  case MESH_ATTRIB_FLOAT4: return sizeof(float) * 4;
+  case MESH_ATTRIB_SNORM16X2: return sizeof(int16_t) * 2;
+  case MESH_ATTRIB_SNORM16X4: return sizeof(int16_t) * 4;
+  case MESH_ATTRIB_HALF2: return sizeof(uint16_t) * 2;
+  case MESH_ATTRIB_HALF4: return sizeof(uint16_t) * 4;
+  case MESH_ATTRIB_UNORM8X4: return sizeof(uint8_t) * 4;
+  case MESH_ATTRIB_OCT16: return sizeof(int16_t) * 2;
+  default: return 0;
+  }
+}
+
+// Rounds to nearest. Values beyond the half range become infinity, values below it flush to zero.
+uint16_t mesh_float_to_half(float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint16_t sign = (uint16_t) ((bits >> 16) & 0x8000u);
+  int32_t exponent = (int32_t) ((bits >> 23) & 0xffu) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffffu;
+
+  if (((bits >> 23) & 0xffu) == 0xffu) {
+    return sign | 0x7c00u | (mantissa ? 0x200u : 0);
+  }
+  if (exponent >= 31) {
+    return sign | 0x7c00u;
+  }
+  if (exponent <= 0) {
+    if (exponent < -10) {
+      return sign;
+    }
+    // Subnormal half: shift the implicit one into the mantissa.
+    mantissa |= 0x800000u;
+    uint32_t shift = (uint32_t) (14 - exponent);
+    uint16_t half = (uint16_t) (mantissa >> shift);
+    if ((mantissa >> (shift - 1)) & 1u) {
+      ++half;
+    }
+    return sign | half;
+  }
+
+  uint16_t half = (uint16_t) (sign | (exponent << 10) | (mantissa >> 13));
+  if (mantissa & 0x1000u) {
+    // May carry into the exponent, which still rounds correctly up to infinity.
+    ++half;
+  }
+  return half;
+}
+
+float mesh_half_to_float(uint16_t value)
+{
+  uint32_t sign = (uint32_t) (value & 0x8000u) << 16;
+  uint32_t exponent = (value >> 10) & 0x1fu;
+  uint32_t mantissa = value & 0x3ffu;
+  uint32_t bits;
+
+  if (exponent == 0) {
+    if (mantissa == 0) {
+      bits = sign;
+    } else {
+      float result = mantissa / 16777216.0f;
+      return (value & 0x8000u) ? -result : result;
+    }
+  } else if (exponent == 31) {
+    bits = sign | 0x7f800000u | (mantissa << 13);
+  } else {
+    bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+  }
+
+  float result;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+int16_t mesh_float_to_snorm16(float value)
+{
+  if (value > 1.0f) {
+    value = 1.0f;
+  } else if (value < -1.0f) {
+    value = -1.0f;
+  }
+  return (int16_t) lrintf(value * 32767.0f);
+}
+
+static float snorm16_to_float(int16_t value)
+{
+  float result = value / 32767.0f;
+  return result < -1.0f ? -1.0f : result;
+}
+
+// Projects the unit vector onto the octahedron |x| + |y| + |z| = 1 and folds the lower half over the diagonals.
+void mesh_oct_encode(const float normal[3], int16_t out[2])
+{
+  float length = fabsf(normal[0]) + fabsf(normal[1]) + fabsf(normal[2]);
+  float x = length > 0.0f ? normal[0] / length : 0.0f;
+  float y = length > 0.0f ? normal[1] / length : 0.0f;
+  if (normal[2] < 0.0f) {
+    float folded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    float folded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = folded_x;
+    y = folded_y;
+  }
+  out[0] = mesh_float_to_snorm16(x);
+  out[1] = mesh_float_to_snorm16(y);
+}
+
+void mesh_oct_decode(const int16_t in[2], float normal[3])
+{
+  float x = snorm16_to_float(in[0]);
+  float y = snorm16_to_float(in[1]);
+  float z = 1.0f - fabsf(x) - fabsf(y);
+  if (z < 0.0f) {
+    float unfolded_x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    float unfolded_y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = unfolded_x;
+    y = unfolded_y;
+  }
+  float length = sqrtf(x * x + y * y + z * z);
+  normal[0] = x / length;
+  normal[1] = y / length;
+  normal[2] = z / length;
+}
+
+// Decodes one attribute the way vertex fetch would, except that octahedral vectors come back as
+// unit vectors. Missing components read as zero. Returns the number of meaningful components.
+uint32_t mesh_decode_attrib(uint32_t format, const void *src, float out[4])
+{
+  out[0] = out[1] = out[2] = out[3] = 0.0f;
+  switch (format) {
+  case MESH_ATTRIB_FLOAT2:
+  case MESH_ATTRIB_FLOAT3:
+  case MESH_ATTRIB_FLOAT4: {
+    uint32_t count = mesh_attrib_format_size(format) / sizeof(float);
+    memcpy(out, src, count * sizeof(float));
+    return count;
+  }
+  case MESH_ATTRIB_SNORM16X2:
+  case MESH_ATTRIB_SNORM16X4: {
+    int16_t values[4];
+    uint32_t count = mesh_attrib_format_size(format) / sizeof(int16_t);
+    memcpy(values, src, count * sizeof(int16_t));
+    for (uint32_t i = 0; i < count; ++i) {
+      out[i] = snorm16_to_float(values[i]);
+    }
+    return count;
+  }
+  case MESH_ATTRIB_HALF2:
+  case MESH_ATTRIB_HALF4: {
+    uint16_t values[4];
+    uint32_t count = mesh_attrib_format_size(format) / sizeof(uint16_t);
+    memcpy(values, src, count * sizeof(uint16_t));
+    for (uint32_t i = 0; i < count; ++i) {
+      out[i] = mesh_half_to_float(values[i]);
+    }
+    return count;
+  }
+  case MESH_ATTRIB_UNORM8X4: {
+    const uint8_t *values = src;
+    for (uint32_t i = 0; i < 4; ++i) {
+      out[i] = values[i] / 255.0f;
+    }
+    return 4;
+  }
+  case MESH_ATTRIB_OCT16: {
+    int16_t values[2];
+    memcpy(values, src, sizeof(values));
+    mesh_oct_decode(values, out);
+    return 3;
+  }
+  default:
+    return 0;
+  }
+}
+
+const MeshAttrib *mesh_find_attrib(const MeshHeader *header, uint32_t location)
+{
+  for (uint32_t i = 0; i < header->attrib_count; ++i) {
+    if (header->attribs[i].location == location) {
+      return &header->attribs[i];
+    }
+  }
+  return NULL;
+}
+
+// Sphere around the axis-aligned box of the location 0 positions as stored, before position_scale
+// and position_offset. Missing components count as zero.
+void mesh_bounding_sphere(const Mesh *mesh, float sphere[4])
+{
+  sphere[0] = sphere[1] = sphere[2] = sphere[3] = 0.0f;
+  const MeshAttrib *position = mesh_find_attrib(&mesh->header, 0);
+  if (position == NULL || mesh->header.vertex_count == 0) {
+    return;
+  }
+
+  float min[3] = {0.0f, 0.0f, 0.0f};
+  float max[3] = {0.0f, 0.0f, 0.0f};
+  for (uint32_t i = 0; i < mesh->header.vertex_count; ++i) {
+    float value[4];
+    mesh_decode_attrib(position->format, (const char *) mesh->vertices + (size_t) i * mesh->header.vertex_stride + position->offset, value);
+    for (uint32_t c = 0; c < 3; ++c) {
+      if (i == 0 || value[c] < min[c]) {
+	min[c] = value[c];
+      }
+      if (i == 0 || value[c] > max[c]) {
+	max[c] = value[c];
+      }
+    }
+  }
+
+  float radius_squared = 0.0f;
+  for (uint32_t c = 0; c < 3; ++c) {
+    sphere[c] = 0.5f * (min[c] + max[c]);
+    float half_extent = 0.5f * (max[c] - min[c]);
+    radius_squared += half_extent * half_extent;
+  }
+  sphere[3] = sqrtf(radius_squared);
+}
+
+static bool mesh_validate(const char *file_path, const MeshHeader *header, size_t file_size)
+{
+  if (header->magic != MESH_MAGIC || header->version < 1 || header->version > MESH_VERSION) {
+    fprintf(stderr, "ERROR: %s is not a version 1 to %u mesh file\n", file_path, MESH_VERSION);
+    return false;
+  }
+  if (!(header->position_scale > 0.0f) || !isfinite(header->position_scale) || !isfinite(header->position_offset[0]) ||
+      !isfinite(header->position_offset[1]) || !isfinite(header->position_offset[2])) {
+    fprintf(stderr, "ERROR: %s has an invalid position scale or offset\n", file_path);
+    return false;
+  }
+  if (header->index_size != 2 && header->index_size != 4) {
+    fprintf(stderr, "ERROR: %s has unsupported index size %u\n", file_path, header->index_size);
+    return false;
+  }
+  if (header->attrib_count == 0 || header->attrib_count > MESH_MAX_ATTRIBS || header->vertex_stride == 0) {
+    fprintf(stderr, "ERROR: %s has an invalid vertex layout\n", file_path);
+    return false;
+  }
+  uint32_t used_locations = 0;
+  for (uint32_t i = 0; i < header->attrib_count; ++i) {
+    const MeshAttrib *attrib = &header->attribs[i];
+    uint32_t size = mesh_attrib_format_size(attrib->format);
+    if (size == 0 || (uint64_t) attrib->offset + size > header->vertex_stride) {
+      fprintf(stderr, "ERROR: %s has an invalid attribute at location %u\n", file_path, attrib->location);
+      return false;
+    }
+    // mesh_find_attrib returns the first match, so a repeated location would silently shadow the later one.
+    if (attrib->location >= MESH_MAX_LOCATION || (used_locations & (1u << attrib->location)) != 0) {
+      fprintf(stderr, "ERROR: %s has a duplicate or out of range attribute location %u\n", file_path, attrib->location);
+      return false;
+    }
+    used_locations |= 1u << attrib->location;
+  }
+
+  uint64_t vertex_bytes = (uint64_t) header->vertex_count * header->vertex_stride;
+  uint64_t index_bytes = (uint64_t) header->index_count * header->index_size;
+  if (header->vertex_offset % MESH_SECTION_ALIGNMENT != 0 || header->index_offset % MESH_SECTION_ALIGNMENT != 0 ||
+      header->vertex_offset < (header->version == 1 ? MESH_V1_HEADER_SIZE : sizeof(MeshHeader)) || header->vertex_offset > file_size ||
+      vertex_bytes > file_size - header->vertex_offset ||
+      header->index_offset > file_size || index_bytes > file_size - header->index_offset) {
+    fprintf(stderr, "ERROR: %s has sections outside the file\n", file_path);
+    return false;
+  }
+  return true;
+}
+
+// Takes ownership of view. Nothing is parsed or copied; the sections are used in place.
+bool mesh_from_view(const char *file_path, AssetView view, Mesh *mesh)
+{
+  *mesh = (Mesh) {0};
+
+  if (view.size < MESH_V1_HEADER_SIZE) {
+    fprintf(stderr, "ERROR: %s is too small to be a mesh file\n", file_path);
+    asset_release(&view);
+    return false;
+  }
+
+  // Version 1 headers end before the position quantization fields.
+  memcpy(&mesh->header, view.data, view.size < sizeof(MeshHeader) ? MESH_V1_HEADER_SIZE : sizeof(MeshHeader));
+  if (mesh->header.version == 1) {
+    mesh->header.position_scale = 1.0f;
+    memset(mesh->header.position_offset, 0, sizeof(mesh->header.position_offset));
+  }
+  if (!mesh_validate(file_path, &mesh->header, view.size)) {
+    asset_release(&view);
+    return false;
+  }
+
+  mesh->view = view;
+  mesh->vertices = (const char *) view.data + mesh->header.vertex_offset;
+  mesh->indices = (const char *) view.data + mesh->header.index_offset;
+  return true;
+}
+
+// Releases the file view. The header stays valid for drawing.
+void mesh_close(Mesh *mesh)
+{
+  asset_release(&mesh->view);
+  mesh->vertices = NULL;
+  mesh->indices = NULL;
+}
+
+static bool write_padding(FILE *file, uint64_t offset)
+{
+  static const char zeros[MESH_SECTION_ALIGNMENT] = {0};
+  size_t padding = (size_t) (align_section(offset) - offset);
+  return fwrite(zeros, 1, padding, file) == padding;
+}
+
+// Fills in the magic, version and section offsets of header and writes the file. A position_scale
+// of zero is written as 1, for callers that store unquantized positions.
+bool mesh_write(const char *file_path, MeshHeader *header, const void *vertices, const void *indices)
+{
+  uint64_t vertex_bytes = (uint64_t) header->vertex_count * header->vertex_stride;
+  uint64_t index_bytes = (uint64_t) header->index_count * header->index_size;
+
+  header->magic = MESH_MAGIC;
+  header->version = MESH_VERSION;
+  if (header->position_scale == 0.0f) {
+    header->position_scale = 1.0f;
+  }
+  header->vertex_offset = align_section(sizeof(MeshHeader));
+  header->index_offset = align_section(header->vertex_offset + vertex_bytes);
+
+  FILE *file = fopen(file_path, "wb");
+  if (file == NULL) {
+    fprintf(stderr, "ERROR: Could not open file %s\n", file_path);
+    return false;
+  }
+
+  bool ok = fwrite(header, sizeof(MeshHeader), 1, file) == 1 &&
+    write_padding(file, sizeof(MeshHeader)) &&
+    fwrite(vertices, 1, vertex_bytes, file) == vertex_bytes &&
+    write_padding(file, header->vertex_offset + vertex_bytes) &&
+    fwrite(indices, 1, index_bytes, file) == index_bytes;
+
+  if (fclose(file) != 0 || !ok) {
+    fprintf(stderr, "ERROR: Could not write file %s\n", file_path);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,87 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "asset.h"
+
+// Binary mesh file, little-endian:
+//   MeshHeader | padding | vertex section | padding | index section
+// Sections start on MESH_SECTION_ALIGNMENT boundaries so they can be copied straight out of the mapping.
+#define MESH_MAGIC 0x4853454du // "MESH"
+#define MESH_VERSION 2
+#define MESH_SECTION_ALIGNMENT 64
+#define MESH_MAX_ATTRIBS 8
+// Attribute locations must stay below the smallest maxVertexInputAttributes Vulkan guarantees.
+#define MESH_MAX_LOCATION 16
+
+// Every format is a core Vulkan vertex format that devices must support. Quantized positions are
+// stored relative to position_offset and divided by position_scale, see MeshHeader.
+typedef enum {
+  MESH_ATTRIB_FLOAT2 = 1,
+  MESH_ATTRIB_FLOAT3 = 2,
+  MESH_ATTRIB_FLOAT4 = 3,
+  MESH_ATTRIB_SNORM16X2 = 4,
+  MESH_ATTRIB_SNORM16X4 = 5,
+  MESH_ATTRIB_HALF2 = 6,
+  MESH_ATTRIB_HALF4 = 7,
+  MESH_ATTRIB_UNORM8X4 = 8,
+  // Unit vector folded onto an octahedron, two SNORM16 components.
+  MESH_ATTRIB_OCT16 = 9,
+}MeshAttribFormat;
+
+typedef struct
+{
+  uint32_t location;
+  uint32_t format;
+  uint32_t offset;
+  uint32_t reserved;
+}MeshAttrib;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t vertex_count;
+  uint32_t vertex_stride;
+  uint32_t index_count;
+  uint32_t index_size;
+  uint32_t attrib_count;
+  uint32_t reserved;
+  uint64_t vertex_offset;
+  uint64_t index_offset;
+  MeshAttrib attribs[MESH_MAX_ATTRIBS];
+  // Since version 2. The position at location 0 is stored * position_scale + position_offset;
+  // version 1 files read as scale 1 and offset 0.
+  float position_scale;
+  float position_offset[3];
+}MeshHeader;
+
+_Static_assert(sizeof(MeshHeader) == 192, "MeshHeader is part of the file format");
+#define MESH_V1_HEADER_SIZE 176
+
+// vertices and indices point into the file view, or into caller memory for built-in meshes.
+typedef struct
+{
+  MeshHeader header;
+  const void *vertices;
+  const void *indices;
+  AssetView view;
+}Mesh;
+
+uint32_t mesh_attrib_format_size(uint32_t format);
+uint32_t mesh_decode_attrib(uint32_t format, const void *src, float out[4]);
+uint16_t mesh_float_to_half(float value);
+float mesh_half_to_float(uint16_t value);
+int16_t mesh_float_to_snorm16(float value);
+void mesh_oct_encode(const float normal[3], int16_t out[2]);
+void mesh_oct_decode(const int16_t in[2], float normal[3]);
+const MeshAttrib *mesh_find_attrib(const MeshHeader *header, uint32_t location);
+bool mesh_from_view(const char *file_path, AssetView view, Mesh *mesh);
+void mesh_close(Mesh *mesh);
+void mesh_bounding_sphere(const Mesh *mesh, float sphere[4]);
+bool mesh_write(const char *file_path, MeshHeader *header, const void *vertices, const void *indices);
+
+#endif // MESH_H
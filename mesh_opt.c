@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "mesh_opt.h"
+
+// Average cache miss ratio: transformed vertices per triangle with a FIFO cache of cache_size
+// entries. 3 is the worst case, around 0.6 is typical for a well ordered mesh. Returns a
+// negative value if memory runs out.
+float mesh_opt_acmr(const uint32_t *indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size)
+{
+  if (index_count < 3) {
+    return 0.0f;
+  }
+
+  // A vertex is cached while fewer than cache_size misses happened since its own.
+  uint32_t *cache_time = calloc(vertex_count, sizeof(uint32_t));
+  if (cache_time == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u vertices\n", vertex_count);
+    return -1.0f;
+  }
+
+  uint32_t time = cache_size + 1;
+  uint32_t misses = 0;
+  for (uint32_t i = 0; i < index_count; ++i) {
+    uint32_t vertex = indices[i];
+    if (time - cache_time[vertex] > cache_size) {
+      cache_time[vertex] = time++;
+      ++misses;
+    }
+  }
+
+  free(cache_time);
+  return (float) misses / (index_count / 3);
+}
+
+static uint32_t hash_bytes(const void *data, uint32_t size)
+{
+  // FNV-1a
+  const unsigned char *bytes = data;
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Merges vertices with identical bytes, which includes vertices that only became equal through
+// quantization. The vertex array is compacted in place and the indices remapped.
+bool mesh_opt_dedup_vertices(void *vertices, uint32_t *vertex_count, uint32_t stride, uint32_t *indices, uint32_t index_count)
+{
+  uint32_t count = *vertex_count;
+  uint32_t table_size = 1;
+  while (table_size < count * 2) {
+    table_size <<= 1;
+  }
+
+  uint32_t *table = malloc(table_size * sizeof(uint32_t));
+  uint32_t *remap = malloc(count * sizeof(uint32_t));
+  if (table == NULL || remap == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u vertices\n", count);
+    free(table);
+    free(remap);
+    return false;
+  }
+  memset(table, 0xff, table_size * sizeof(uint32_t));
+
+  char *data = vertices;
+  uint32_t unique = 0;
+  for (uint32_t v = 0; v < count; ++v) {
+    const char *vertex = data + (size_t) v * stride;
+    uint32_t slot = hash_bytes(vertex, stride) & (table_size - 1);
+    while (table[slot] != UINT32_MAX && memcmp(data + (size_t) table[slot] * stride, vertex, stride) != 0) {
+      slot = (slot + 1) & (table_size - 1);
+    }
+    if (table[slot] == UINT32_MAX) {
+      if (unique != v) {
+	memcpy(data + (size_t) unique * stride, vertex, stride);
+      }
+      table[slot] = unique;
+      remap[v] = unique++;
+    } else {
+      remap[v] = table[slot];
+    }
+  }
+
+  for (uint32_t i = 0; i < index_count; ++i) {
+    indices[i] = remap[indices[i]];
+  }
+  *vertex_count = unique;
+
+  free(table);
+  free(remap);
+  return true;
+}
+
+// Returns the next vertex to fan around: the dead-end stack holds recently emitted vertices,
+// after that the cursor scans the remaining ones in order.
+static int64_t skip_dead_end(const uint32_t *live, const uint32_t *dead_end, uint32_t *dead_end_count, uint32_t *cursor, uint32_t vertex_count)
+{
+  while (*dead_end_count > 0) {
+    uint32_t vertex = dead_end[--*dead_end_count];
+    if (live[vertex] > 0) {
+      return vertex;
+    }
+  }
+  while (*cursor < vertex_count) {
+    uint32_t vertex = (*cursor)++;
+    if (live[vertex] > 0) {
+      return vertex;
+    }
+  }
+  return -1;
+}
+
+// Tipsify (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw", 2007). Emits all remaining triangles around one vertex, then moves on to the
+// vertex just emitted that will still be in the cache after its own remaining triangles.
+bool mesh_opt_reorder_triangles(uint32_t *indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size)
+{
+  uint32_t triangle_count = index_count / 3;
+  uint32_t *offsets = calloc((size_t) vertex_count + 1, sizeof(uint32_t));
+  uint32_t *live = calloc(vertex_count, sizeof(uint32_t));
+  uint32_t *cache_time = calloc(vertex_count, sizeof(uint32_t));
+  uint32_t *adjacency = malloc((size_t) triangle_count * 3 * sizeof(uint32_t));
+  uint32_t *dead_end = malloc((size_t) triangle_count * 3 * sizeof(uint32_t));
+  uint32_t *output = malloc((size_t) triangle_count * 3 * sizeof(uint32_t));
+  bool *emitted = calloc(triangle_count, sizeof(bool));
+  bool ok = offsets != NULL && live != NULL && cache_time != NULL && adjacency != NULL && dead_end != NULL && output != NULL && emitted != NULL;
+  if (!ok) {
+    fprintf(stderr, "ERROR: Could not allocate %u triangles\n", triangle_count);
+    goto cleanup;
+  }
+
+  for (uint32_t i = 0; i < triangle_count * 3; ++i) {
+    ++live[indices[i]];
+  }
+  for (uint32_t v = 0; v < vertex_count; ++v) {
+    offsets[v + 1] = offsets[v] + live[v];
+  }
+  // offsets[v] walks to the end of v's range while filling, then is rewound by live[v].
+  for (uint32_t t = 0; t < triangle_count; ++t) {
+    for (uint32_t corner = 0; corner < 3; ++corner) {
+      adjacency[offsets[indices[t * 3 + corner]]++] = t;
+    }
+  }
+  for (uint32_t v = 0; v < vertex_count; ++v) {
+    offsets[v] -= live[v];
+  }
+
+  uint32_t time = cache_size + 1;
+  uint32_t output_count = 0;
+  uint32_t dead_end_count = 0;
+  uint32_t cursor = 0;
+  int64_t fan = skip_dead_end(live, dead_end, &dead_end_count, &cursor, vertex_count);
+  while (fan >= 0) {
+    // The vertices emitted for this fan are the candidates for the next one.
+    uint32_t fan_start = output_count;
+    for (uint32_t a = offsets[fan]; a < offsets[fan + 1]; ++a) {
+      uint32_t t = adjacency[a];
+      if (emitted[t]) {
+	continue;
+      }
+      for (uint32_t corner = 0; corner < 3; ++corner) {
+	uint32_t vertex = indices[t * 3 + corner];
+	output[output_count++] = vertex;
+	dead_end[dead_end_count++] = vertex;
+	--live[vertex];
+	if (time - cache_time[vertex] > cache_size) {
+	  cache_time[vertex] = time++;
+	}
+      }
+      emitted[t] = true;
+    }
+
+    int64_t next = -1;
+    int64_t best = -1;
+    for (uint32_t i = fan_start; i < output_count; ++i) {
+      uint32_t vertex = output[i];
+      if (live[vertex] == 0) {
+	continue;
+      }
+      // Fanning around a vertex emits at most 2 new vertices per triangle; prefer the oldest
+      // vertex that survives that in the cache.
+      int64_t priority = 0;
+      if (time - cache_time[vertex] + 2 * live[vertex] <= cache_size) {
+	priority = time - cache_time[vertex];
+      }
+      if (priority > best) {
+	best = priority;
+	next = vertex;
+      }
+    }
+    fan = next >= 0 ? next : skip_dead_end(live, dead_end, &dead_end_count, &cursor, vertex_count);
+  }
+
+  memcpy(indices, output, (size_t) output_count * sizeof(uint32_t));
+
+cleanup:
+  free(offsets);
+  free(live);
+  free(cache_time);
+  free(adjacency);
+  free(dead_end);
+  free(output);
+  free(emitted);
+  return ok;
+}
+
+// Renumbers the vertices in the order the indices first reference them, so vertex fetch walks
+// the buffer mostly forward. Unreferenced vertices are dropped.
+bool mesh_opt_reorder_vertices(void *vertices, uint32_t *vertex_count, uint32_t stride, uint32_t *indices, uint32_t index_count)
+{
+  uint32_t count = *vertex_count;
+  uint32_t *remap = malloc(count * sizeof(uint32_t));
+  char *reordered = malloc((size_t) count * stride);
+  if (remap == NULL || reordered == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u vertices\n", count);
+    free(remap);
+    free(reordered);
+    return false;
+  }
+  memset(remap, 0xff, count * sizeof(uint32_t));
+
+  uint32_t next = 0;
+  for (uint32_t i = 0; i < index_count; ++i) {
+    uint32_t vertex = indices[i];
+    if (remap[vertex] == UINT32_MAX) {
+      remap[vertex] = next;
+      memcpy(reordered + (size_t) next * stride, (const char *) vertices + (size_t) vertex * stride, stride);
+      ++next;
+    }
+    indices[i] = remap[vertex];
+  }
+
+  memcpy(vertices, reordered, (size_t) next * stride);
+  *vertex_count = next;
+
+  free(remap);
+  free(reordered);
+  return true;
+}
+
+// 16 bit indices whenever every vertex is addressable. Primitive restart is never enabled, so
+// 0xffff is an ordinary index.
+uint32_t mesh_opt_index_size(uint32_t vertex_count)
+{
+  return vertex_count <= UINT16_MAX + 1u ? sizeof(uint16_t) : sizeof(uint32_t);
+}
@@ -0,0 +1,19 @@
+#ifndef MESH_OPT_H
+#define MESH_OPT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Import-time passes over an indexed triangle list with 32 bit indices. Vertices are opaque
+// blocks of stride bytes, so the passes work on any layout, quantized or not.
+
+// Entries of the simulated FIFO post-transform cache used for ACMR and triangle ordering.
+#define MESH_OPT_CACHE_SIZE 16
+
+float mesh_opt_acmr(const uint32_t *indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size);
+bool mesh_opt_dedup_vertices(void *vertices, uint32_t *vertex_count, uint32_t stride, uint32_t *indices, uint32_t index_count);
+bool mesh_opt_reorder_triangles(uint32_t *indices, uint32_t index_count, uint32_t vertex_count, uint32_t cache_size);
+bool mesh_opt_reorder_vertices(void *vertices, uint32_t *vertex_count, uint32_t stride, uint32_t *indices, uint32_t index_count);
+uint32_t mesh_opt_index_size(uint32_t vertex_count);
+
+#endif // MESH_OPT_H
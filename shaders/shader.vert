@@ -1,17 +1,56 @@
 #version 450
 
+layout(constant_id = 0) const bool PUSH_MODEL = false;
+layout(constant_id = 1) const bool GPU_CULL = false;
+
 layout(binding = 0) uniform UniformBufferObject {
-  mat4 model;
-  mat4 view;
-  mat4 proj;
+  mat4 mvp;
 } ubo;
 
-layout(location = 0) in vec2 inPosition;
-layout(location = 1) in vec3 inColor;
+layout(push_constant) uniform PushConstants {
+  mat4 mvp;
+} push;
+
+struct Instance {
+  mat4 model;
+  vec4 color;
+};
+
+// Written by cull.comp: the instance and draw behind each gl_InstanceIndex of a culled draw.
+layout(std430, binding = 1) readonly buffer Visible {
+  uvec2 visible[];
+};
 
-layout(location = 0) out vec3 fragColor;
+layout(std430, binding = 2) readonly buffer Instances {
+  Instance instances[];
+};
+
+layout(std430, binding = 3) readonly buffer DrawMvps {
+  mat4 draw_mvps[];
+};
+
+layout(location = 0) in vec3 inPosition;
+// Vertex colors without alpha read as opaque.
+layout(location = 1) in vec4 inColor;
+layout(location = 2) in mat4 inInstanceModel;
+layout(location = 6) in vec4 inInstanceColor;
+
+layout(location = 0) out vec4 fragColor;
 
 void main() {
-  gl_Position = ubo.proj * ubo.view * ubo.model * vec4(inPosition, 0.0, 1.0);
-  fragColor = inColor;
+  mat4 mvp;
+  mat4 model;
+  vec4 color;
+  if (GPU_CULL) {
+    uvec2 entry = visible[gl_InstanceIndex];
+    mvp = draw_mvps[entry.y];
+    model = instances[entry.x].model;
+    color = instances[entry.x].color;
+  } else {
+    mvp = PUSH_MODEL ? push.mvp : ubo.mvp;
+    model = inInstanceModel;
+    color = inInstanceColor;
+  }
+  gl_Position = mvp * model * vec4(inPosition, 1.0);
+  fragColor = inColor * color;
 }
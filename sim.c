@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "util.h"
+#include "sim.h"
+
+#define SIM_STATE_FRESH 0x4u
+#define SIM_STATE_INDEX 0x3u
+// Radians per second, replaces the old fixed increment per rendered frame.
+#define SIM_ROTATION_SPEED 0.5
+// After a stall longer than this the simulation skips ahead instead of replaying every missed step.
+#define SIM_MAX_CATCH_UP_MS 250.0
+
+// Writer side. Hands the back slot over and takes whatever slot was in the middle.
+static void sim_state_publish(SimStateBuffer *buffer)
+{
+  uint32_t old_middle = atomic_exchange_explicit(&buffer->middle, buffer->back | SIM_STATE_FRESH, memory_order_acq_rel);
+  buffer->back = old_middle & SIM_STATE_INDEX;
+}
+
+// Reader side. Takes the newest published slot if there is one, otherwise keeps the current one.
+static const SimState *sim_state_consume(SimStateBuffer *buffer)
+{
+  if (atomic_load_explicit(&buffer->middle, memory_order_relaxed) & SIM_STATE_FRESH) {
+    uint32_t old_middle = atomic_exchange_explicit(&buffer->middle, buffer->front, memory_order_acq_rel);
+    buffer->front = old_middle & SIM_STATE_INDEX;
+  }
+  return &buffer->slots[buffer->front];
+}
+
+static void sim_step(SimState *state, double step_ms)
+{
+  state->prev_angle = state->angle;
+  state->angle += SIM_ROTATION_SPEED * step_ms / 1000.0;
+  state->time_ms += step_ms;
+  ++state->step;
+}
+
+static void sleep_until_ms(double target_ms)
+{
+  struct timespec ts = {
+    .tv_sec = (time_t) (target_ms / 1000.0),
+  };
+  ts.tv_nsec = (long) ((target_ms - ts.tv_sec * 1000.0) * 1000000.0);
+  if (ts.tv_nsec >= 1000000000L) {
+    ts.tv_nsec = 999999999L;
+  }
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void *sim_thread(void *arg)
+{
+  Simulation *sim = arg;
+  SimState state = sim->states.slots[sim->states.back];
+
+  while (!atomic_load_explicit(&sim->stopping, memory_order_relaxed)) {
+    double next_step_ms = state.time_ms + sim->step_ms;
+    double now = time_now_ms();
+    if (now < next_step_ms) {
+      sleep_until_ms(next_step_ms);
+      continue;
+    }
+    if (now - next_step_ms > SIM_MAX_CATCH_UP_MS) {
+      state.time_ms = now - sim->step_ms;
+    }
+
+    sim_step(&state, sim->step_ms);
+    sim->states.slots[sim->states.back] = state;
+    sim_state_publish(&sim->states);
+  }
+  return NULL;
+}
+
+void sim_start(Simulation *sim, double step_ms)
+{
+  *sim = (Simulation) {
+    .step_ms = step_ms,
+  };
+
+  SimState initial = {
+    .time_ms = time_now_ms(),
+  };
+  for (uint32_t i = 0; i < 3; ++i) {
+    sim->states.slots[i] = initial;
+  }
+  sim->states.back = 0;
+  sim->states.front = 1;
+  atomic_init(&sim->states.middle, 2);
+  atomic_init(&sim->stopping, false);
+
+  if (pthread_create(&sim->thread, NULL, sim_thread, sim) != 0) {
+    fprintf(stderr, "ERROR: Could not start simulation thread\n");
+    exit(1);
+  }
+}
+
+void sim_stop(Simulation *sim)
+{
+  atomic_store(&sim->stopping, true);
+  pthread_join(sim->thread, NULL);
+}
+
+// Returns the newest published state, interpolated between its last two steps at now_ms. Rendering
+// trails the simulation by up to one step in exchange for never extrapolating.
+SimState sim_sample(Simulation *sim, double now_ms)
+{
+  SimState sample = *sim_state_consume(&sim->states);
+  double alpha = (now_ms - sample.time_ms) / sim->step_ms;
+  if (alpha < 0.0) {
+    alpha = 0.0;
+  } else if (alpha > 1.0) {
+    alpha = 1.0;
+  }
+
+  sample.angle = fmod(sample.prev_angle + (sample.angle - sample.prev_angle) * alpha, 2.0 * M_PI);
+  return sample;
+}
@@ -0,0 +1,43 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+// Scene state after one fixed simulation step. prev_angle is the state one step earlier,
+// so a reader can interpolate without keeping its own history.
+typedef struct
+{
+  double time_ms;
+  uint64_t step;
+  double prev_angle;
+  double angle;
+}SimState;
+
+// Single producer, single consumer triple buffer. The writer owns back, the reader owns front,
+// and the two swap through middle, which also carries a flag for unread data. Neither side
+// ever blocks the other.
+typedef struct
+{
+  SimState slots[3];
+  uint32_t back;
+  uint32_t front;
+  _Atomic uint32_t middle;
+}SimStateBuffer;
+
+// Steps the scene at a fixed rate on its own thread, independent of the frame rate.
+typedef struct
+{
+  SimStateBuffer states;
+  double step_ms;
+  pthread_t thread;
+  atomic_bool stopping;
+}Simulation;
+
+void sim_start(Simulation *sim, double step_ms);
+void sim_stop(Simulation *sim);
+SimState sim_sample(Simulation *sim, double now_ms);
+
+#endif // SIM_H
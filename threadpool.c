@@ -0,0 +1,149 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "threadpool.h"
+
+// One worker per online CPU, leaving the main thread its own core.
+uint32_t thread_pool_default_size()
+{
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus <= 2) {
+    return 1;
+  }
+  return (uint32_t) (cpus - 1);
+}
+
+static void *thread_pool_worker(void *arg)
+{
+  ThreadPool *pool = arg;
+
+  pthread_mutex_lock(&pool->mutex);
+  for (;;) {
+    while (pool->job_count == 0 && !pool->stopping) {
+      pthread_cond_wait(&pool->job_ready, &pool->mutex);
+    }
+    if (pool->job_count == 0) {
+      break;
+    }
+
+    ThreadPoolJob job = pool->jobs[pool->job_first];
+    pool->job_first = (pool->job_first + 1) % pool->job_capacity;
+    --pool->job_count;
+    pthread_mutex_unlock(&pool->mutex);
+
+    job.fn(job.arg);
+
+    pthread_mutex_lock(&pool->mutex);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+  return NULL;
+}
+
+void thread_pool_init(ThreadPool *pool, uint32_t thread_count)
+{
+  *pool = (ThreadPool) {0};
+  pool->thread_count = thread_count ? thread_count : thread_pool_default_size();
+  pool->threads = malloc(pool->thread_count * sizeof(pthread_t));
+  if (pool->threads == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u worker threads\n", pool->thread_count);
+    exit(1);
+  }
+
+  pthread_mutex_init(&pool->mutex, NULL);
+  pthread_cond_init(&pool->job_ready, NULL);
+
+  for (uint32_t i = 0; i < pool->thread_count; ++i) {
+    if (pthread_create(&pool->threads[i], NULL, thread_pool_worker, pool) != 0) {
+      fprintf(stderr, "ERROR: Could not start worker thread\n");
+      exit(1);
+    }
+  }
+}
+
+void thread_pool_submit(ThreadPool *pool, ThreadPoolFn fn, void *arg)
+{
+  pthread_mutex_lock(&pool->mutex);
+  if (pool->job_count == pool->job_capacity) {
+    // Unwrap the ring into a larger array.
+    uint32_t new_capacity = pool->job_capacity ? pool->job_capacity * 2 : 16;
+    ThreadPoolJob *jobs = malloc(new_capacity * sizeof(ThreadPoolJob));
+    if (jobs == NULL) {
+      fprintf(stderr, "ERROR: Could not grow job queue to %u jobs\n", new_capacity);
+      exit(1);
+    }
+    for (uint32_t i = 0; i < pool->job_count; ++i) {
+      jobs[i] = pool->jobs[(pool->job_first + i) % pool->job_capacity];
+    }
+    free(pool->jobs);
+    pool->jobs = jobs;
+    pool->job_capacity = new_capacity;
+    pool->job_first = 0;
+  }
+
+  pool->jobs[(pool->job_first + pool->job_count) % pool->job_capacity] = (ThreadPoolJob) {.fn = fn, .arg = arg};
+  ++pool->job_count;
+  pthread_cond_signal(&pool->job_ready);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+// Finishes every queued job, then joins the workers.
+void thread_pool_destroy(ThreadPool *pool)
+{
+  pthread_mutex_lock(&pool->mutex);
+  pool->stopping = true;
+  pthread_cond_broadcast(&pool->job_ready);
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (uint32_t i = 0; i < pool->thread_count; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&pool->job_ready);
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool->jobs);
+  free(pool->threads);
+  *pool = (ThreadPool) {0};
+}
+
+void wait_group_init(WaitGroup *group)
+{
+  group->pending = 0;
+  pthread_mutex_init(&group->mutex, NULL);
+  pthread_cond_init(&group->done, NULL);
+}
+
+void wait_group_add(WaitGroup *group, uint32_t count)
+{
+  pthread_mutex_lock(&group->mutex);
+  group->pending += count;
+  pthread_mutex_unlock(&group->mutex);
+}
+
+void wait_group_done(WaitGroup *group)
+{
+  pthread_mutex_lock(&group->mutex);
+  if (--group->pending == 0) {
+    pthread_cond_broadcast(&group->done);
+  }
+  pthread_mutex_unlock(&group->mutex);
+}
+
+void wait_group_wait(WaitGroup *group)
+{
+  pthread_mutex_lock(&group->mutex);
+  while (group->pending > 0) {
+    pthread_cond_wait(&group->done, &group->mutex);
+  }
+  pthread_mutex_unlock(&group->mutex);
+}
+
+void wait_group_destroy(WaitGroup *group)
+{
+  pthread_cond_destroy(&group->done);
+  pthread_mutex_destroy(&group->mutex);
+}
@@ -0,0 +1,50 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+typedef void (*ThreadPoolFn)(void *arg);
+
+typedef struct
+{
+  ThreadPoolFn fn;
+  void *arg;
+}ThreadPoolJob;
+
+// Fixed set of worker threads servicing a FIFO of jobs. Jobs signal their own completion,
+// usually through a WaitGroup.
+typedef struct
+{
+  pthread_t *threads;
+  uint32_t thread_count;
+  pthread_mutex_t mutex;
+  pthread_cond_t job_ready;
+  ThreadPoolJob *jobs;
+  uint32_t job_capacity;
+  uint32_t job_first;
+  uint32_t job_count;
+  bool stopping;
+}ThreadPool;
+
+// Counts outstanding jobs so a caller can wait for just the jobs it submitted.
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t done;
+  uint32_t pending;
+}WaitGroup;
+
+uint32_t thread_pool_default_size();
+void thread_pool_init(ThreadPool *pool, uint32_t thread_count);
+void thread_pool_submit(ThreadPool *pool, ThreadPoolFn fn, void *arg);
+void thread_pool_destroy(ThreadPool *pool);
+
+void wait_group_init(WaitGroup *group);
+void wait_group_add(WaitGroup *group, uint32_t count);
+void wait_group_done(WaitGroup *group);
+void wait_group_wait(WaitGroup *group);
+void wait_group_destroy(WaitGroup *group);
+
+#endif // THREADPOOL_H
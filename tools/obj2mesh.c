@@ -0,0 +1,391 @@
+// Converts a Wavefront OBJ file into the binary mesh format loaded with --mesh.
+// Positions and optional per-vertex colors ("v x y z r g b") are kept; polygons are fan triangulated.
+// Attributes can be written in quantized formats, and smooth normals can be generated from the faces.
+// Unless --no-optimize is given, the mesh is deduplicated and reordered for the vertex caches.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "../mesh.h"
+#include "../mesh_opt.h"
+#include "../util.h"
+
+// First location after the instance attributes in main.c.
+#define NORMAL_LOCATION 7
+
+typedef struct
+{
+  float position[3];
+  float color[3];
+  float normal[3];
+}ObjVertex;
+
+typedef struct
+{
+  ObjVertex *vertices;
+  uint32_t vertex_count;
+  uint32_t vertex_capacity;
+  uint32_t *indices;
+  uint32_t index_count;
+  uint32_t index_capacity;
+}ObjMesh;
+
+static bool parse_face_index(const char *token, uint32_t vertex_count, uint32_t *index)
+{
+  // Only the position index is used, "v", "v/vt", "v//vn" and "v/vt/vn" all start with it.
+  char *end;
+  long value = strtol(token, &end, 10);
+  if (end == token || value == 0) {
+    return false;
+  }
+  if (value < 0) {
+    value += (long) vertex_count + 1;
+  }
+  if (value < 1 || value > (long) vertex_count) {
+    return false;
+  }
+  *index = (uint32_t) (value - 1);
+  return true;
+}
+
+static void push_index(ObjMesh *mesh, uint32_t index)
+{
+  mesh->indices = array_reserve(mesh->indices, &mesh->index_capacity, mesh->index_count + 1, sizeof(uint32_t));
+  mesh->indices[mesh->index_count++] = index;
+}
+
+static bool parse_obj(const char *file_path, ObjMesh *mesh)
+{
+  FILE *file = fopen(file_path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "ERROR: Could not open file %s\n", file_path);
+    return false;
+  }
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+  uint32_t line_number = 0;
+  bool ok = true;
+  while (ok && getline(&line, &line_capacity, file) != -1) {
+    ++line_number;
+    if (line[0] == 'v' && line[1] == ' ') {
+      // "v x y z", "v x y z w" with the weight ignored, or "v x y z r g b" with a vertex color.
+      float values[6];
+      int read = sscanf(line + 2, "%f %f %f %f %f %f", &values[0], &values[1], &values[2], &values[3], &values[4], &values[5]);
+      if (read != 3 && read != 4 && read != 6) {
+	fprintf(stderr, "ERROR: %s:%u: Invalid vertex\n", file_path, line_number);
+	ok = false;
+	break;
+      }
+      ObjVertex vertex = {
+	.position = {values[0], values[1], values[2]},
+	.color = {1.0f, 1.0f, 1.0f},
+      };
+      if (read == 6) {
+	memcpy(vertex.color, &values[3], sizeof(vertex.color));
+      }
+      mesh->vertices = array_reserve(mesh->vertices, &mesh->vertex_capacity, mesh->vertex_count + 1, sizeof(ObjVertex));
+      mesh->vertices[mesh->vertex_count++] = vertex;
+    } else if (line[0] == 'f' && line[1] == ' ') {
+      uint32_t first = 0, previous = 0;
+      uint32_t corners = 0;
+      for (char *token = strtok(line + 2, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+	uint32_t index;
+	if (!parse_face_index(token, mesh->vertex_count, &index)) {
+	  fprintf(stderr, "ERROR: %s:%u: Invalid face index '%s'\n", file_path, line_number, token);
+	  ok = false;
+	  break;
+	}
+	if (corners == 0) {
+	  first = index;
+	} else if (corners >= 2) {
+	  push_index(mesh, first);
+	  push_index(mesh, previous);
+	  push_index(mesh, index);
+	}
+	previous = index;
+	++corners;
+      }
+      if (ok && corners < 3) {
+	fprintf(stderr, "ERROR: %s:%u: Face with fewer than 3 vertices\n", file_path, line_number);
+	ok = false;
+      }
+    }
+  }
+
+  free(line);
+  fclose(file);
+  return ok;
+}
+
+// Area weighted: the unnormalized cross product of each triangle is added to its corners.
+static void compute_normals(ObjMesh *mesh)
+{
+  for (uint32_t i = 0; i < mesh->index_count; i += 3) {
+    const float *a = mesh->vertices[mesh->indices[i]].position;
+    const float *b = mesh->vertices[mesh->indices[i + 1]].position;
+    const float *c = mesh->vertices[mesh->indices[i + 2]].position;
+    float ab[3] = {b[0] - a[0], b[1] - a[1], b[2] - a[2]};
+    float ac[3] = {c[0] - a[0], c[1] - a[1], c[2] - a[2]};
+    float cross[3] = {ab[1] * ac[2] - ab[2] * ac[1], ab[2] * ac[0] - ab[0] * ac[2], ab[0] * ac[1] - ab[1] * ac[0]};
+    for (uint32_t corner = 0; corner < 3; ++corner) {
+      float *normal = mesh->vertices[mesh->indices[i + corner]].normal;
+      for (uint32_t c = 0; c < 3; ++c) {
+	normal[c] += cross[c];
+      }
+    }
+  }
+
+  for (uint32_t i = 0; i < mesh->vertex_count; ++i) {
+    float *normal = mesh->vertices[i].normal;
+    float length = sqrtf(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+    if (length > 0.0f) {
+      normal[0] /= length;
+      normal[1] /= length;
+      normal[2] /= length;
+    } else {
+      // Unreferenced or degenerate, any unit vector will do.
+      normal[0] = 0.0f;
+      normal[1] = 0.0f;
+      normal[2] = 1.0f;
+    }
+  }
+}
+
+static bool parse_format(const char *option, const char *value, const char *const *names, const uint32_t *formats, uint32_t count, uint32_t *format)
+{
+  for (uint32_t i = 0; i < count; ++i) {
+    if (value != NULL && strcmp(value, names[i]) == 0) {
+      *format = formats[i];
+      return true;
+    }
+  }
+  fprintf(stderr, "ERROR: Invalid value '%s' for %s\n", value != NULL ? value : "", option);
+  return false;
+}
+
+static void add_attrib(MeshHeader *header, uint32_t location, uint32_t format)
+{
+  MeshAttrib *attrib = &header->attribs[header->attrib_count++];
+  attrib->location = location;
+  attrib->format = format;
+  attrib->offset = header->vertex_stride;
+  // Keeps every attribute 4 byte aligned, as vertex fetch prefers.
+  header->vertex_stride += (mesh_attrib_format_size(format) + 3) & ~3u;
+}
+
+// Centers the positions on their bounding box and scales the largest half extent to 1, which is
+// what the SNORM16 format can hold and keeps half floats in their most precise range.
+static void compute_position_quantization(const ObjMesh *mesh, MeshHeader *header)
+{
+  float min[3], max[3];
+  memcpy(min, mesh->vertices[0].position, sizeof(min));
+  memcpy(max, mesh->vertices[0].position, sizeof(max));
+  for (uint32_t i = 1; i < mesh->vertex_count; ++i) {
+    for (uint32_t c = 0; c < 3; ++c) {
+      min[c] = fminf(min[c], mesh->vertices[i].position[c]);
+      max[c] = fmaxf(max[c], mesh->vertices[i].position[c]);
+    }
+  }
+
+  float half_extent = 0.0f;
+  for (uint32_t c = 0; c < 3; ++c) {
+    header->position_offset[c] = 0.5f * (min[c] + max[c]);
+    half_extent = fmaxf(half_extent, 0.5f * (max[c] - min[c]));
+  }
+  header->position_scale = half_extent > 0.0f ? half_extent : 1.0f;
+}
+
+static void encode_vertex(const MeshHeader *header, const ObjVertex *vertex, char *dst)
+{
+  for (uint32_t i = 0; i < header->attrib_count; ++i) {
+    const MeshAttrib *attrib = &header->attribs[i];
+    const float *src = attrib->location == 0 ? vertex->position : attrib->location == 1 ? vertex->color : vertex->normal;
+    float value[4] = {src[0], src[1], src[2], 1.0f};
+    if (attrib->location == 0 && attrib->format != MESH_ATTRIB_FLOAT3) {
+      for (uint32_t c = 0; c < 3; ++c) {
+	value[c] = (value[c] - header->position_offset[c]) / header->position_scale;
+      }
+    }
+
+    char *out = dst + attrib->offset;
+    switch (attrib->format) {
+    case MESH_ATTRIB_FLOAT3:
+      memcpy(out, value, sizeof(float) * 3);
+      break;
+    case MESH_ATTRIB_SNORM16X4: {
+      int16_t packed[4];
+      for (uint32_t c = 0; c < 4; ++c) {
+	packed[c] = mesh_float_to_snorm16(value[c]);
+      }
+      memcpy(out, packed, sizeof(packed));
+      break;
+    }
+    case MESH_ATTRIB_HALF4: {
+      uint16_t packed[4];
+      for (uint32_t c = 0; c < 4; ++c) {
+	packed[c] = mesh_float_to_half(value[c]);
+      }
+      memcpy(out, packed, sizeof(packed));
+      break;
+    }
+    case MESH_ATTRIB_UNORM8X4:
+      for (uint32_t c = 0; c < 4; ++c) {
+	float clamped = fminf(fmaxf(value[c], 0.0f), 1.0f);
+	out[c] = (char) (uint8_t) lrintf(clamped * 255.0f);
+      }
+      break;
+    case MESH_ATTRIB_OCT16: {
+      int16_t packed[2];
+      mesh_oct_encode(value, packed);
+      memcpy(out, packed, sizeof(packed));
+      break;
+    }
+    }
+  }
+}
+
+static void report_step(const char *step, const uint32_t *indices, uint32_t index_count, uint32_t vertex_count)
+{
+  printf("  %-20s ACMR %.3f, %u vertices\n", step, mesh_opt_acmr(indices, index_count, vertex_count, MESH_OPT_CACHE_SIZE), vertex_count);
+}
+
+// Runs on the encoded vertices, so vertices that quantize to the same bytes are merged too.
+static bool optimize_mesh(char *vertices, MeshHeader *header, uint32_t *indices)
+{
+  printf("Optimizing for a %u entry vertex cache:\n", MESH_OPT_CACHE_SIZE);
+  report_step("input", indices, header->index_count, header->vertex_count);
+  if (!mesh_opt_dedup_vertices(vertices, &header->vertex_count, header->vertex_stride, indices, header->index_count)) {
+    return false;
+  }
+  report_step("deduplicated", indices, header->index_count, header->vertex_count);
+  if (!mesh_opt_reorder_triangles(indices, header->index_count, header->vertex_count, MESH_OPT_CACHE_SIZE)) {
+    return false;
+  }
+  report_step("triangles reordered", indices, header->index_count, header->vertex_count);
+  if (!mesh_opt_reorder_vertices(vertices, &header->vertex_count, header->vertex_stride, indices, header->index_count)) {
+    return false;
+  }
+  report_step("vertices reordered", indices, header->index_count, header->vertex_count);
+  return true;
+}
+
+static void usage(const char *program)
+{
+  fprintf(stderr, "Usage: %s [options] <input.obj> <output.mesh>\n"
+	  "  --position float|half|snorm16  Position format (default float)\n"
+	  "  --color float|unorm8           Color format (default float)\n"
+	  "  --normals none|float|oct16     Generate smooth normals at location %u (default none)\n"
+	  "  --no-optimize                  Keep the vertex and triangle order of the OBJ file\n",
+	  program, NORMAL_LOCATION);
+}
+
+int main(int argc, char **argv)
+{
+  static const char *const position_names[] = {"float", "half", "snorm16"};
+  static const uint32_t position_formats[] = {MESH_ATTRIB_FLOAT3, MESH_ATTRIB_HALF4, MESH_ATTRIB_SNORM16X4};
+  static const char *const color_names[] = {"float", "unorm8"};
+  static const uint32_t color_formats[] = {MESH_ATTRIB_FLOAT3, MESH_ATTRIB_UNORM8X4};
+  static const char *const normal_names[] = {"none", "float", "oct16"};
+  static const uint32_t normal_formats[] = {0, MESH_ATTRIB_FLOAT3, MESH_ATTRIB_OCT16};
+
+  uint32_t position_format = MESH_ATTRIB_FLOAT3;
+  uint32_t color_format = MESH_ATTRIB_FLOAT3;
+  uint32_t normal_format = 0;
+  bool optimize = true;
+  const char *paths[2];
+  uint32_t path_count = 0;
+  for (int i = 1; i < argc; ++i) {
+    const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    bool ok = true;
+    if (strcmp(argv[i], "--position") == 0) {
+      ok = parse_format(argv[i], value, position_names, position_formats, 3, &position_format);
+      ++i;
+    } else if (strcmp(argv[i], "--color") == 0) {
+      ok = parse_format(argv[i], value, color_names, color_formats, 2, &color_format);
+      ++i;
+    } else if (strcmp(argv[i], "--normals") == 0) {
+      ok = parse_format(argv[i], value, normal_names, normal_formats, 3, &normal_format);
+      ++i;
+    } else if (strcmp(argv[i], "--no-optimize") == 0) {
+      optimize = false;
+    } else if (argv[i][0] == '-' || path_count == 2) {
+      ok = false;
+    } else {
+      paths[path_count++] = argv[i];
+    }
+    if (!ok) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (path_count != 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  ObjMesh obj = {0};
+  if (!parse_obj(paths[0], &obj)) {
+    return 1;
+  }
+  if (obj.vertex_count == 0 || obj.index_count == 0) {
+    fprintf(stderr, "ERROR: %s has no triangles\n", paths[0]);
+    return 1;
+  }
+
+  MeshHeader header = {
+    .vertex_count = obj.vertex_count,
+    .index_count = obj.index_count,
+    .position_scale = 1.0f,
+  };
+  add_attrib(&header, 0, position_format);
+  add_attrib(&header, 1, color_format);
+  if (normal_format != 0) {
+    add_attrib(&header, NORMAL_LOCATION, normal_format);
+    compute_normals(&obj);
+  }
+  if (position_format != MESH_ATTRIB_FLOAT3) {
+    compute_position_quantization(&obj, &header);
+  }
+
+  char *vertices = calloc(obj.vertex_count, header.vertex_stride);
+  if (vertices == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u vertices\n", obj.vertex_count);
+    return 1;
+  }
+  for (uint32_t i = 0; i < obj.vertex_count; ++i) {
+    encode_vertex(&header, &obj.vertices[i], vertices + (size_t) i * header.vertex_stride);
+  }
+  if (optimize && !optimize_mesh(vertices, &header, obj.indices)) {
+    return 1;
+  }
+  // Chosen after optimization, which may have merged or dropped enough vertices to fit 16 bits.
+  header.index_size = mesh_opt_index_size(header.vertex_count);
+
+  uint16_t *narrow_indices = NULL;
+  if (header.index_size == sizeof(uint16_t)) {
+    narrow_indices = malloc(obj.index_count * sizeof(uint16_t));
+    if (narrow_indices == NULL) {
+      fprintf(stderr, "ERROR: Could not allocate %u indices\n", obj.index_count);
+      return 1;
+    }
+    for (uint32_t i = 0; i < obj.index_count; ++i) {
+      narrow_indices[i] = (uint16_t) obj.indices[i];
+    }
+  }
+
+  bool ok = mesh_write(paths[1], &header, vertices, narrow_indices != NULL ? (void *) narrow_indices : (void *) obj.indices);
+  if (ok) {
+    printf("%s: %u vertices of %u bytes, %u triangles, %u bit indices\n", paths[1], header.vertex_count, header.vertex_stride,
+	   header.index_count / 3, header.index_size * 8);
+  }
+
+  free(narrow_indices);
+  free(vertices);
+  free(obj.vertices);
+  free(obj.indices);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,93 @@
+// Microbenchmark for the batched MVP kernels. Times every kernel the CPU supports against the scalar
+// cglm path on the same structure-of-arrays input and checks that their results agree.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+
+#include "../transform.h"
+#include "../util.h"
+
+#define DEFAULT_OBJECT_COUNT 10000
+#define DEFAULT_ITERATIONS 1000
+// Matches a uniform buffer slice with the common 256-byte minUniformBufferOffsetAlignment.
+#define DST_STRIDE 256
+
+int main(int argc, char **argv)
+{
+  if (argc > 3) {
+    fprintf(stderr, "Usage: %s [objects] [iterations]\n", argv[0]);
+    return 1;
+  }
+  uint32_t object_count = argc > 1 ? (uint32_t) strtoul(argv[1], NULL, 10) : DEFAULT_OBJECT_COUNT;
+  uint32_t iterations = argc > 2 ? (uint32_t) strtoul(argv[2], NULL, 10) : DEFAULT_ITERATIONS;
+  if (object_count == 0 || iterations == 0) {
+    fprintf(stderr, "ERROR: objects and iterations must be positive\n");
+    return 1;
+  }
+
+  TransformSoA models;
+  transform_soa_init(&models, object_count);
+  srand(1);
+  for (uint32_t i = 0; i < object_count; ++i) {
+    mat4 model;
+    glm_mat4_identity(model);
+    glm_translate(model, (vec3) {rand() / (float) RAND_MAX, rand() / (float) RAND_MAX, rand() / (float) RAND_MAX});
+    glm_rotate(model, rand() / (float) RAND_MAX * 6.28f, (vec3) {0.0f, 0.0f, 1.0f});
+    glm_scale_uni(model, 0.5f + rand() / (float) RAND_MAX);
+    transform_soa_set(&models, i, model);
+  }
+
+  mat4 view;
+  mat4 proj;
+  mat4 view_proj;
+  glm_lookat((vec3) {2.0f, 2.0f, 2.0f}, (vec3) {0.0f, 0.0f, 0.0f}, (vec3) {0.0f, 0.0f, 1.0f}, view);
+  glm_perspective(45.0f, 800.0f / 600.0f, 0.1f, 10.0f, proj);
+  glm_mat4_mul(proj, view, view_proj);
+
+  char *reference = malloc((size_t) object_count * DST_STRIDE);
+  char *dst = malloc((size_t) object_count * DST_STRIDE);
+  if (reference == NULL || dst == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate output for %u objects\n", object_count);
+    return 1;
+  }
+  transform_batch_mvp(TRANSFORM_KERNEL_SCALAR, view_proj, &models, reference, DST_STRIDE);
+
+  printf("{\n  \"objects\": %u,\n  \"iterations\": %u,\n  \"kernels\": {", object_count, iterations);
+  bool first = true;
+  for (int kernel = 0; kernel < TRANSFORM_KERNEL_COUNT; ++kernel) {
+    if (!transform_kernel_supported(kernel)) {
+      continue;
+    }
+
+    double start = time_now_ms();
+    for (uint32_t i = 0; i < iterations; ++i) {
+      transform_batch_mvp(kernel, view_proj, &models, dst, DST_STRIDE);
+    }
+    double elapsed = time_now_ms() - start;
+
+    float max_error = 0.0f;
+    for (uint32_t i = 0; i < object_count; ++i) {
+      const float *expected = (const float *) (reference + (size_t) i * DST_STRIDE);
+      const float *actual = (const float *) (dst + (size_t) i * DST_STRIDE);
+      for (uint32_t e = 0; e < 16; ++e) {
+	float error = fabsf(expected[e] - actual[e]);
+	if (error > max_error) {
+	  max_error = error;
+	}
+      }
+    }
+
+    printf("%s\n    \"%s\": {\"ns_per_object\": %.3f, \"max_abs_error\": %g}", first ? "" : ",",
+	   transform_kernel_name(kernel), elapsed * 1000000.0 / ((double) iterations * object_count), max_error);
+    first = false;
+  }
+  printf("\n  }\n}\n");
+
+  free(reference);
+  free(dst);
+  transform_soa_free(&models);
+  return 0;
+}
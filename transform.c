@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "transform.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TRANSFORM_X86 1
+#endif
+
+#define TRANSFORM_BATCH 8
+
+void transform_soa_init(TransformSoA *soa, uint32_t count)
+{
+  soa->count = count;
+  soa->stride = (count + TRANSFORM_BATCH - 1) / TRANSFORM_BATCH * TRANSFORM_BATCH;
+  if (soa->stride == 0) {
+    soa->stride = TRANSFORM_BATCH;
+  }
+  size_t size = 16 * (size_t) soa->stride * sizeof(float);
+  soa->elements = aligned_alloc(32, size);
+  if (soa->elements == NULL) {
+    fprintf(stderr, "ERROR: Could not allocate %u transforms\n", count);
+    exit(1);
+  }
+  memset(soa->elements, 0, size);
+}
+
+void transform_soa_free(TransformSoA *soa)
+{
+  free(soa->elements);
+  *soa = (TransformSoA) {0};
+}
+
+void transform_soa_set(TransformSoA *soa, uint32_t index, mat4 model)
+{
+  for (uint32_t c = 0; c < 4; ++c) {
+    for (uint32_t r = 0; r < 4; ++r) {
+      soa->elements[(c * 4 + r) * soa->stride + index] = model[c][r];
+    }
+  }
+}
+
+void transform_soa_get(const TransformSoA *soa, uint32_t index, mat4 model)
+{
+  for (uint32_t c = 0; c < 4; ++c) {
+    for (uint32_t r = 0; r < 4; ++r) {
+      model[c][r] = soa->elements[(c * 4 + r) * soa->stride + index];
+    }
+  }
+}
+
+// Reference path: gathers each model back into a mat4 and multiplies it with cglm.
+static void transform_mvp_scalar(mat4 view_proj, const TransformSoA *models, uint32_t first, void *dst, size_t dst_stride)
+{
+  for (uint32_t i = first; i < models->count; ++i) {
+    mat4 model;
+    transform_soa_get(models, i, model);
+
+    mat4 mvp;
+    glm_mat4_mul(view_proj, model, mvp);
+    memcpy((char *) dst + i * dst_stride, mvp, sizeof(mat4));
+  }
+}
+
+#ifdef TRANSFORM_X86
+// (view_proj * model)[c][r] = sum over k of view_proj[k][r] * model[c][k]. view_proj is broadcast,
+// each model element is a vector of consecutive objects, so there are no horizontal operations.
+// The 16 result vectors are transposed back to one column-major matrix per object on the way out.
+static uint32_t transform_mvp_sse(mat4 view_proj, const TransformSoA *models, void *dst, size_t dst_stride)
+{
+  __m128 vp[16];
+  for (uint32_t e = 0; e < 16; ++e) {
+    vp[e] = _mm_set1_ps(view_proj[e / 4][e % 4]);
+  }
+
+  uint32_t i = 0;
+  for (; i + 4 <= models->count; i += 4) {
+    __m128 m[16];
+    for (uint32_t e = 0; e < 16; ++e) {
+      m[e] = _mm_load_ps(models->elements + e * models->stride + i);
+    }
+
+    for (uint32_t c = 0; c < 4; ++c) {
+      __m128 col[4];
+      for (uint32_t r = 0; r < 4; ++r) {
+	col[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(vp[0 * 4 + r], m[c * 4 + 0]), _mm_mul_ps(vp[1 * 4 + r], m[c * 4 + 1])),
+			    _mm_add_ps(_mm_mul_ps(vp[2 * 4 + r], m[c * 4 + 2]), _mm_mul_ps(vp[3 * 4 + r], m[c * 4 + 3])));
+      }
+      _MM_TRANSPOSE4_PS(col[0], col[1], col[2], col[3]);
+      for (uint32_t j = 0; j < 4; ++j) {
+	_mm_storeu_ps((float *) ((char *) dst + (i + j) * dst_stride) + c * 4, col[j]);
+      }
+    }
+  }
+  return i;
+}
+
+__attribute__((target("avx2,fma")))
+static uint32_t transform_mvp_avx2(mat4 view_proj, const TransformSoA *models, void *dst, size_t dst_stride)
+{
+  __m256 vp[16];
+  for (uint32_t e = 0; e < 16; ++e) {
+    vp[e] = _mm256_set1_ps(view_proj[e / 4][e % 4]);
+  }
+
+  uint32_t i = 0;
+  for (; i + 8 <= models->count; i += 8) {
+    __m256 m[16];
+    for (uint32_t e = 0; e < 16; ++e) {
+      m[e] = _mm256_load_ps(models->elements + e * models->stride + i);
+    }
+
+    for (uint32_t c = 0; c < 4; ++c) {
+      __m256 col[4];
+      for (uint32_t r = 0; r < 4; ++r) {
+	__m256 sum = _mm256_mul_ps(vp[0 * 4 + r], m[c * 4 + 0]);
+	sum = _mm256_fmadd_ps(vp[1 * 4 + r], m[c * 4 + 1], sum);
+	sum = _mm256_fmadd_ps(vp[2 * 4 + r], m[c * 4 + 2], sum);
+	col[r] = _mm256_fmadd_ps(vp[3 * 4 + r], m[c * 4 + 3], sum);
+      }
+
+      // 4x4 transpose within each 128-bit lane: the low lane holds objects i..i+3, the high lane i+4..i+7.
+      __m256 t0 = _mm256_unpacklo_ps(col[0], col[1]);
+      __m256 t1 = _mm256_unpackhi_ps(col[0], col[1]);
+      __m256 t2 = _mm256_unpacklo_ps(col[2], col[3]);
+      __m256 t3 = _mm256_unpackhi_ps(col[2], col[3]);
+      __m256 objs[4] = {
+	_mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0)),
+	_mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2)),
+	_mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0)),
+	_mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2)),
+      };
+      for (uint32_t j = 0; j < 4; ++j) {
+	_mm_storeu_ps((float *) ((char *) dst + (i + j) * dst_stride) + c * 4, _mm256_castps256_ps128(objs[j]));
+	_mm_storeu_ps((float *) ((char *) dst + (i + j + 4) * dst_stride) + c * 4, _mm256_extractf128_ps(objs[j], 1));
+      }
+    }
+  }
+  return i;
+}
+#endif
+
+bool transform_kernel_supported(TransformKernel kernel)
+{
+  switch (kernel) {
+  case TRANSFORM_KERNEL_SCALAR:
+    return true;
+#ifdef TRANSFORM_X86
+  case TRANSFORM_KERNEL_SSE:
+    return true;
+  case TRANSFORM_KERNEL_AVX2:
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+  default:
+    return false;
+  }
+}
+
+TransformKernel transform_best_kernel()
+{
+  for (int kernel = TRANSFORM_KERNEL_COUNT - 1; kernel > TRANSFORM_KERNEL_SCALAR; --kernel) {
+    if (transform_kernel_supported(kernel)) {
+      return kernel;
+    }
+  }
+  return TRANSFORM_KERNEL_SCALAR;
+}
+
+const char *transform_kernel_name(TransformKernel kernel)
+{
+  switch (kernel) {
+  case TRANSFORM_KERNEL_SSE:
+    return "sse";
+  case TRANSFORM_KERNEL_AVX2:
+    return "avx2";
+  default:
+    return "scalar";
+  }
+}
+
+// Writes view_proj * model for every object to dst, one column-major mat4 every dst_stride bytes.
+// dst can be mapped uniform or instance memory; it is only ever written, in whole 16-byte columns.
+void transform_batch_mvp(TransformKernel kernel, mat4 view_proj, const TransformSoA *models, void *dst, size_t dst_stride)
+{
+  uint32_t done = 0;
+#ifdef TRANSFORM_X86
+  if (kernel == TRANSFORM_KERNEL_AVX2) {
+    done = transform_mvp_avx2(view_proj, models, dst, dst_stride);
+  } else if (kernel == TRANSFORM_KERNEL_SSE) {
+    done = transform_mvp_sse(view_proj, models, dst, dst_stride);
+  }
+#else
+  (void) kernel;
+#endif
+  transform_mvp_scalar(view_proj, models, done, dst, dst_stride);
+}
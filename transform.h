@@ -0,0 +1,36 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cglm/cglm.h"
+
+// Model matrices as a structure of arrays. Element e of object i's column-major matrix lives at
+// elements[e * stride + i], so a SIMD register holds the same element of consecutive objects.
+// stride is padded to a whole AVX batch and the array is 32-byte aligned.
+typedef struct
+{
+  float *elements;
+  uint32_t count;
+  uint32_t stride;
+}TransformSoA;
+
+typedef enum {
+  TRANSFORM_KERNEL_SCALAR,
+  TRANSFORM_KERNEL_SSE,
+  TRANSFORM_KERNEL_AVX2,
+  TRANSFORM_KERNEL_COUNT,
+}TransformKernel;
+
+void transform_soa_init(TransformSoA *soa, uint32_t count);
+void transform_soa_free(TransformSoA *soa);
+void transform_soa_set(TransformSoA *soa, uint32_t index, mat4 model);
+void transform_soa_get(const TransformSoA *soa, uint32_t index, mat4 model);
+bool transform_kernel_supported(TransformKernel kernel);
+TransformKernel transform_best_kernel();
+const char *transform_kernel_name(TransformKernel kernel);
+void transform_batch_mvp(TransformKernel kernel, mat4 view_proj, const TransformSoA *models, void *dst, size_t dst_stride);
+
+#endif // TRANSFORM_H
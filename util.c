@@ -1,40 +1,86 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "util.h"
 
-FileInfo get_file_info(const char *file_path)
+uint32_t clamp_u32(uint32_t value, uint32_t min, uint32_t max) {
+    if (value < min) return min;
+    if (value > max) return max;
+    return value;
+}
+
+// Writes to a temporary file next to file_path and renames it into place, so a crash
+// leaves either the old file or the complete new one, never a torn write.
+bool write_file_atomic(const char *file_path, const void *data, size_t size)
 {
-  FileInfo file_info = {0};
-  FILE* file;
-  if ((file = fopen(file_path, "r")) == NULL) {
-    fprintf(stderr, "ERROR: Could not open file %s", file_path);
-    return file_info;
+  char tmp_path[4096];
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%ld", file_path, (long) getpid()) >= (int) sizeof(tmp_path)) {
+    fprintf(stderr, "ERROR: Path too long %s\n", file_path);
+    return false;
   }
 
-  fseek(file, 0, SEEK_END);
-  size_t file_size = ftell(file); 
-  fseek(file, 0, SEEK_SET);
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open file %s\n", tmp_path);
+    return false;
+  }
 
-  char* file_contents = malloc(file_size);
+  const char *bytes = data;
+  size_t written = 0;
+  while (written < size) {
+    ssize_t result = write(fd, bytes + written, size - written);
+    if (result < 0) {
+      fprintf(stderr, "ERROR: Could not write file %s\n", tmp_path);
+      close(fd);
+      unlink(tmp_path);
+      return false;
+    }
+    written += (size_t) result;
+  }
 
-  if (file_contents == NULL) {
-    fprintf(stderr, "ERROR: Could not allocate buffer contents of file %s", file_path);
-    fclose(file);
-    return file_info;
+  if (fsync(fd) != 0 || close(fd) != 0) {
+    fprintf(stderr, "ERROR: Could not flush file %s\n", tmp_path);
+    unlink(tmp_path);
+    return false;
   }
 
-  fread(file_contents, 1, file_size, file);
-  
-  fclose(file);
-  file_info.content = file_contents;
-  file_info.size = file_size;
-  return file_info;
+  if (rename(tmp_path, file_path) != 0) {
+    fprintf(stderr, "ERROR: Could not move %s to %s\n", tmp_path, file_path);
+    unlink(tmp_path);
+    return false;
+  }
+  return true;
 }
 
-uint32_t clamp_u32(uint32_t value, uint32_t min, uint32_t max) {
-    if (value < min) return min;
-    if (value > max) return max;
-    return value;
+// Grows a heap array geometrically so it holds at least needed elements.
+void *array_reserve(void *array, uint32_t *capacity, uint32_t needed, size_t elem_size)
+{
+  if (needed <= *capacity) {
+    return array;
+  }
+
+  uint32_t new_capacity = *capacity ? *capacity : 8;
+  while (new_capacity < needed) {
+    new_capacity *= 2;
+  }
+
+  void *grown = realloc(array, (size_t) new_capacity * elem_size);
+  if (grown == NULL) {
+    fprintf(stderr, "ERROR: Could not grow array to %u elements\n", new_capacity);
+    exit(1);
+  }
+  *capacity = new_capacity;
+  return grown;
+}
+
+double time_now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
 }
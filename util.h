@@ -1,14 +1,9 @@
 #ifndef UTIL_H
 #define UTIL_H
 
-typedef struct FileInfo
-{
-  char *content;
-  size_t size;
-
-}FileInfo;
-
-FileInfo get_file_info(const char *file_path);
 uint32_t clamp_u32(uint32_t value, uint32_t min, uint32_t max);
+double time_now_ms();
+bool write_file_atomic(const char *file_path, const void *data, size_t size);
+void *array_reserve(void *array, uint32_t *capacity, uint32_t needed, size_t elem_size);
   
 #endif // UTIL_H